@@ -0,0 +1,262 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <bitset>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+
+#include "Regex.h"
+
+namespace MQ2Discord
+{
+	/// The last so many KB of chat, whether or not any channel wanted it, so it can be looked at from discord after the fact.
+	///
+	/// Memory is fixed: chat goes into a ring of blocks, and once they're all full the oldest block is cleared for new lines. Each block
+	/// keeps the time of its last line and a bloom filter of their trigrams, so a search skips blocks that are too old or can't contain
+	/// the text, and only scans the rest. Lines are added on the main thread and searched on the background thread. The lock is only
+	/// held one block at a time, so a search never holds up the game for more than scanning a few KB.
+	class ChatHistory
+	{
+	public:
+		/// A line found in the history
+		struct Line
+		{
+			std::chrono::system_clock::time_point time;
+			std::string text;
+		};
+
+		/// How much of the history a search had to look at
+		struct SearchStats
+		{
+			size_t blocks = 0;
+			size_t blocksScanned = 0;
+		};
+
+		/// Text in each block. Chat lines are always under this, so every line fits.
+		static constexpr size_t BlockBytes = 8192;
+
+		explicit ChatHistory(size_t capacityKb) : _blocks(std::max<size_t>(capacityKb * 1024 / BlockBytes, 2)), _capacityKb(capacityKb)
+		{
+			for (auto& block : _blocks)
+				block.text.reserve(BlockBytes);
+		}
+
+		ChatHistory(const ChatHistory&) = delete;
+		ChatHistory& operator=(const ChatHistory&) = delete;
+
+		size_t capacityKb() const
+		{
+			return _capacityKb;
+		}
+
+		/// Local time of day a line was seen, as HH:MM:SS
+		static std::string timeOfDay(std::chrono::system_clock::time_point time)
+		{
+			const auto seconds = std::chrono::system_clock::to_time_t(time);
+			std::tm local{};
+#ifdef _WIN32
+			localtime_s(&local, &seconds);
+#else
+			localtime_r(&seconds, &local);
+#endif
+			char buffer[16];
+			std::strftime(buffer, sizeof(buffer), "%H:%M:%S", &local);
+			return buffer;
+		}
+
+		/// Remember a line of chat. Colour codes are removed.
+		void add(std::string_view line)
+		{
+			_scratch.clear();
+			for (size_t i = 0; i < line.size() && _scratch.size() < BlockBytes; ++i)
+			{
+				// Colour codes are \a and a letter, or \a- and a letter for the dark version
+				if (line[i] == '\a')
+				{
+					i += i + 1 < line.size() && line[i + 1] == '-' ? 2 : 1;
+					continue;
+				}
+				_scratch.push_back(line[i]);
+			}
+			if (_scratch.empty())
+				return;
+
+			const auto now = std::chrono::system_clock::now();
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			auto * block = &_blocks[_current];
+			if (block->text.size() + _scratch.size() > BlockBytes)
+			{
+				// Move on to the next block, forgetting the oldest lines
+				_current = (_current + 1) % _blocks.size();
+				block = &_blocks[_current];
+				block->text.clear();
+				block->lines.clear();
+				block->trigrams.reset();
+				++block->generation;
+			}
+
+			block->last = now;
+			block->lines.push_back({ static_cast<uint32_t>(block->text.size()), static_cast<uint32_t>(_scratch.size()), now });
+			block->text.append(_scratch);
+			forEachTrigram(_scratch, [&](uint32_t trigram) {
+				const auto bits = bloomBits(trigram);
+				block->trigrams.set(bits.first);
+				block->trigrams.set(bits.second);
+			});
+		}
+
+		/// The last count lines, oldest first
+		std::vector<Line> tail(size_t count)
+		{
+			std::vector<Line> results;
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (size_t i = 0; i < _blocks.size() && results.size() < count; ++i)
+			{
+				const auto& block = _blocks[(_current + _blocks.size() - i) % _blocks.size()];
+				for (auto it = block.lines.rbegin(); it != block.lines.rend() && results.size() < count; ++it)
+					results.push_back({ it->time, block.text.substr(it->offset, it->length) });
+			}
+			std::reverse(results.begin(), results.end());
+			return results;
+		}
+
+		/// The last maxResults lines from the last window of time that contain pattern, ignoring case, oldest first.
+		/// A pattern starting with re: is a regular expression, which can't use the trigram index so scans every block in the window.
+		/// Sets error and returns nothing if the regular expression doesn't compile.
+		std::vector<Line> grep(const std::string& pattern, std::chrono::system_clock::duration window, size_t maxResults, SearchStats& stats, std::string& error)
+		{
+			std::vector<Line> results;
+			stats = SearchStats();
+
+			RegexSet regex;
+			std::vector<bool> regexMatches;
+			const bool isRegex = RegexSet::isRegexFilter(pattern);
+			if (isRegex && !regex.add(pattern.substr(strlen(RegexSet::FilterPrefix)), error))
+				return results;
+
+			std::vector<std::pair<size_t, size_t>> bits;
+			std::string needle;
+			if (!isRegex)
+			{
+				for (auto c : pattern)
+					needle.push_back(static_cast<char>(tolower(static_cast<unsigned char>(c))));
+				forEachTrigram(needle, [&](uint32_t trigram) { bits.push_back(bloomBits(trigram)); });
+			}
+
+			const auto cutoff = std::chrono::system_clock::now() - window;
+			std::string text;
+			size_t start;
+			std::vector<uint64_t> generations;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				start = _current;
+				for (const auto& block : _blocks)
+					generations.push_back(block.generation);
+			}
+
+			// Newest block first, so the search can stop as soon as it has enough, or gets to blocks older than the window
+			for (size_t i = 0; i < _blocks.size() && results.size() < maxResults; ++i)
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				const auto index = (start + _blocks.size() - i) % _blocks.size();
+				const auto& block = _blocks[index];
+
+				// A block that's been reused since the search started has newer lines than the ones already found, and so will every older one
+				if (block.lines.empty() || block.last < cutoff || (i > 0 && block.generation != generations[index]))
+					break;
+
+				++stats.blocks;
+				if (!std::all_of(bits.begin(), bits.end(), [&](const auto& bit) { return block.trigrams.test(bit.first) && block.trigrams.test(bit.second); }))
+					continue;
+
+				++stats.blocksScanned;
+				for (auto it = block.lines.rbegin(); it != block.lines.rend() && results.size() < maxResults; ++it)
+				{
+					if (it->time < cutoff)
+						break;
+
+					const std::string_view line(block.text.data() + it->offset, it->length);
+					bool found;
+					if (isRegex)
+					{
+						text.assign(line);
+						found = regex.match(text.c_str(), regexMatches);
+					}
+					else
+					{
+						found = std::search(line.begin(), line.end(), needle.begin(), needle.end(), [](char a, char b) {
+							return tolower(static_cast<unsigned char>(a)) == b;
+						}) != line.end();
+					}
+					if (found)
+						results.push_back({ it->time, std::string(line) });
+				}
+			}
+
+			std::reverse(results.begin(), results.end());
+			return results;
+		}
+
+	private:
+		/// Bits in each block's trigram bloom filter. A full block has a few thousand different trigrams, so this keeps false positives rare.
+		static constexpr size_t BloomBits = 32768;
+
+		struct LineInfo
+		{
+			uint32_t offset;
+			uint32_t length;
+			std::chrono::system_clock::time_point time;
+		};
+
+		struct Block
+		{
+			std::string text;
+			std::vector<LineInfo> lines;
+			std::bitset<BloomBits> trigrams;
+
+			/// Time of the last line
+			std::chrono::system_clock::time_point last;
+
+			/// How many times the block has been cleared and reused
+			uint64_t generation = 0;
+		};
+
+		std::mutex _mutex;
+		std::vector<Block> _blocks;
+		const size_t _capacityKb;
+
+		/// Block new lines are going into
+		size_t _current = 0;
+
+		/// Line being added, without colour codes. Only used from the main thread.
+		std::string _scratch;
+
+		/// Every trigram of the text, lowercased
+		template<typename F>
+		static void forEachTrigram(std::string_view text, F callback)
+		{
+			uint32_t trigram = 0;
+			for (size_t i = 0; i < text.size(); ++i)
+			{
+				trigram = ((trigram << 8) | static_cast<uint8_t>(tolower(static_cast<unsigned char>(text[i])))) & 0xFFFFFF;
+				if (i >= 2)
+					callback(trigram);
+			}
+		}
+
+		/// Two bits for a trigram, from either end of a multiplicative hash
+		static std::pair<size_t, size_t> bloomBits(uint32_t trigram)
+		{
+			const auto hash = trigram * 0x9E3779B97F4A7C15ull;
+			return { static_cast<size_t>(hash >> 49) % BloomBits, static_cast<size_t>(hash >> 7) % BloomBits };
+		}
+	};
+}
@@ -5,20 +5,48 @@
 #include <map>
 #include <yaml-cpp/node/node.h>
 #include <regex>
+#include <algorithm>
+#include <cstring>
+
+#include "Regex.h"
 
 struct ChannelConfig
 {
-	ChannelConfig() : allow_commands(false), send_connected(true), show_command_response(2000) { }
+	ChannelConfig() : allow_commands(false), send_connected(true), show_command_response(2000), rolling(false), rolling_per_filter(false), rolling_interval(5000), embeds(false), embed_color(0), attachment_threshold(0), attachment_compress(false), dedup(false), dedup_window(2000),
+		rollup(false), rollup_interval(60000), rollup_top(10), rollup_capacity(64),
+		transport("discord"), transport_max_size(64), transport_keep(5), weight(1) { }
 
 	std::string name;
 	std::string id;
 	std::vector<std::string> allowed;
 	std::vector<std::string> blocked;
 	std::vector<std::string> notify;
+	std::vector<std::string> colors;
+	std::vector<std::string> exclude_colors;
 	std::string prefix;
 	bool send_connected;
 	bool allow_commands;
 	uint32_t show_command_response;
+	bool rolling;
+	bool rolling_per_filter;
+	uint32_t rolling_interval;
+	bool embeds;
+	uint32_t embed_color;
+	uint32_t attachment_threshold;
+	bool attachment_compress;
+	bool dedup;
+	uint32_t dedup_window;
+	bool rollup;
+	std::string rollup_key;
+	std::string rollup_value;
+	uint32_t rollup_interval;
+	uint32_t rollup_top;
+	uint32_t rollup_capacity;
+	std::string transport;
+	std::string transport_target;
+	uint32_t transport_max_size;
+	uint32_t transport_keep;
+	uint32_t weight;
 };
 
 struct GroupConfig
@@ -30,7 +58,12 @@ struct GroupConfig
 
 struct DiscordConfig
 {
+	DiscordConfig() : token_assignment("hash"), verdict_cache_size(4096), verdict_cache_verify(0), commands_per_pulse(0),
+		frame_budget_us(0), frame_budget_mode("defer"), resume_sessions(true), history_kb(0), global_rate_limit(50) { }
+
 	std::string token;
+	std::vector<std::string> tokens;
+	std::string token_assignment;
 	std::vector<std::string> user_ids;
 
 	std::vector<ChannelConfig> all;
@@ -39,6 +72,27 @@ struct DiscordConfig
 	std::map<std::string, std::vector<ChannelConfig>> classes;
 	std::vector<GroupConfig> groups;
 
+	uint32_t verdict_cache_size;
+	uint32_t verdict_cache_verify;
+	uint32_t commands_per_pulse;
+	uint32_t frame_budget_us;
+	std::string frame_budget_mode;
+	bool resume_sessions;
+	uint32_t history_kb;
+	uint32_t global_rate_limit;
+
+	/// token and tokens combined
+	std::vector<std::string> allTokens() const
+	{
+		std::vector<std::string> results;
+		if (!token.empty())
+			results.push_back(token);
+		for (const auto& t : tokens)
+			if (!t.empty() && std::find(results.begin(), results.end(), t) == results.end())
+				results.push_back(t);
+		return results;
+	}
+
 	std::vector<std::string> warnings() const
 	{
 		std::vector<std::string> results;
@@ -56,29 +110,72 @@ struct DiscordConfig
 		std::vector<std::string> results;
 		std::regex idRegex("^\\d+$");
 
+		if (allTokens().empty())
+			results.push_back("No \aytoken\aw configured");
+
+		if (token_assignment != "hash" && token_assignment != "budget")
+			results.push_back("Token assignment \ay" + token_assignment + "\aw should be \ayhash\aw or \aybudget");
+
+		if (frame_budget_mode != "defer" && frame_budget_mode != "shed")
+			results.push_back("Frame budget mode \ay" + frame_budget_mode + "\aw should be \aydefer\aw or \ayshed");
+
+		// Only discord needs a real channel id, local transports can use any name but need somewhere to send to
+		const std::regex udpTargetRegex("^.+:\\d+$");
+		const auto checkChannel = [&](const ChannelConfig& channel, const std::string& where) {
+			if (channel.transport == "discord")
+			{
+				if (!std::regex_match(channel.id, idRegex))
+					results.push_back("Channel id \ay" + channel.id + "\aw in " + where + " looks wrong");
+			}
+			else if (channel.transport == "file")
+			{
+				if (channel.transport_target.empty())
+					results.push_back("Channel \ay" + channel.id + "\aw in " + where + " needs a \aytransport_target\aw file");
+			}
+			else if (channel.transport == "udp")
+			{
+				if (!std::regex_match(channel.transport_target, udpTargetRegex))
+					results.push_back("Channel \ay" + channel.id + "\aw in " + where + " needs a \aytransport_target\aw like \ay127.0.0.1:9999");
+			}
+			else
+			{
+				results.push_back("Transport \ay" + channel.transport + "\aw in " + where + " should be \aydiscord\aw, \ayfile\aw or \ayudp");
+			}
+
+			if (channel.weight == 0)
+				results.push_back("Channel \ay" + channel.id + "\aw in " + where + " needs a \ayweight\aw of at least 1");
+
+			for (const auto * filters : { &channel.allowed, &channel.blocked, &channel.notify })
+			{
+				for (const auto& filter : *filters)
+				{
+					if (!MQ2Discord::RegexSet::isRegexFilter(filter))
+						continue;
+					const auto error = MQ2Discord::RegexSet::check(filter.substr(strlen(MQ2Discord::RegexSet::FilterPrefix)));
+					if (!error.empty())
+						results.push_back("Filter \ay" + filter + "\aw in " + where + " isn't a valid regular expression: " + error);
+				}
+			}
+		};
+
 		for (const auto& channel : all)
-			if (!std::regex_match(channel.id, idRegex))
-				results.push_back("Channel id \ay" + channel.id + "\aw in \ayall\aw looks wrong");
+			checkChannel(channel, "\ayall\aw");
 
 		for (const auto& character : characters)
 			for (const auto& channel : character.second)
-				if (!std::regex_match(channel.id, idRegex))
-					results.push_back("Channel id \ay" + channel.id + "\aw in character \ay" + character.first + "\aw looks wrong");
+				checkChannel(channel, "character \ay" + character.first + "\aw");
 
 		for (const auto& server : servers)
 			for (const auto& channel : server.second)
-				if (!std::regex_match(channel.id, idRegex))
-					results.push_back("Channel id \ay" + channel.id + "\aw in server \ay" + server.first + "\aw looks wrong");
+				checkChannel(channel, "server \ay" + server.first + "\aw");
 
 		for (const auto& cls : classes)
 			for (const auto& channel : cls.second)
-				if (!std::regex_match(channel.id, idRegex))
-					results.push_back("Channel id \ay" + channel.id + "\aw in class \ay" + cls.first + "\aw looks wrong");
+				checkChannel(channel, "class \ay" + cls.first + "\aw");
 
 		for (const auto& group : groups)
 			for (const auto& channel : group.channels)
-				if (!std::regex_match(channel.id, idRegex))
-					results.push_back("Channel id \ay" + channel.id + "\aw in group \ay" + group.name + "\aw looks wrong");
+				checkChannel(channel, "group \ay" + group.name + "\aw");
 
 /*
 		const std::regex tokenRegex(R"(.*[\w\-_]{24}\.[\w\-_]{6}\.[\w\-_]{27,}.*)");
@@ -96,17 +193,32 @@ namespace YAML {
 		static Node encode(const DiscordConfig& rhs) {
 			Node node;
 			node["token"] = rhs.token;
+			node["tokens"] = rhs.tokens;
+			node["token_assignment"] = rhs.token_assignment;
 			node["user_ids"] = rhs.user_ids;
 			node["characters"] = rhs.characters;
 			node["servers"] = rhs.servers;
 			node["classes"] = rhs.classes;
 			node["groups"] = rhs.groups;
 			node["all"] = rhs.all;
+			node["verdict_cache_size"] = rhs.verdict_cache_size;
+			node["verdict_cache_verify"] = rhs.verdict_cache_verify;
+			node["commands_per_pulse"] = rhs.commands_per_pulse;
+			node["frame_budget_us"] = rhs.frame_budget_us;
+			node["frame_budget_mode"] = rhs.frame_budget_mode;
+			node["resume_sessions"] = rhs.resume_sessions;
+			node["history_kb"] = rhs.history_kb;
+			node["global_rate_limit"] = rhs.global_rate_limit;
 			return node;
 		}
 
 		static bool decode(const Node& node, DiscordConfig& rhs) {
-			rhs.token = node["token"].as<std::string>();
+			if (node["token"])
+				rhs.token = node["token"].as<std::string>();
+			if (node["tokens"] && node["tokens"].IsSequence())
+				rhs.tokens = node["tokens"].as<std::vector<std::string>>();
+			if (node["token_assignment"])
+				rhs.token_assignment = node["token_assignment"].as<std::string>();
 			rhs.user_ids = node["user_ids"].as<std::vector<std::string>>();
 			if (node["characters"])
 				rhs.characters = node["characters"].as<std::map<std::string, std::vector<ChannelConfig>>>();
@@ -118,6 +230,22 @@ namespace YAML {
 				rhs.groups = node["groups"].as<std::vector<GroupConfig>>();
 			if (node["all"])
 				rhs.all = node["all"].as<std::vector<ChannelConfig>>();
+			if (node["verdict_cache_size"])
+				rhs.verdict_cache_size = node["verdict_cache_size"].as<uint32_t>();
+			if (node["verdict_cache_verify"])
+				rhs.verdict_cache_verify = node["verdict_cache_verify"].as<uint32_t>();
+			if (node["commands_per_pulse"])
+				rhs.commands_per_pulse = node["commands_per_pulse"].as<uint32_t>();
+			if (node["frame_budget_us"])
+				rhs.frame_budget_us = node["frame_budget_us"].as<uint32_t>();
+			if (node["frame_budget_mode"])
+				rhs.frame_budget_mode = node["frame_budget_mode"].as<std::string>();
+			if (node["resume_sessions"])
+				rhs.resume_sessions = node["resume_sessions"].as<bool>();
+			if (node["history_kb"])
+				rhs.history_kb = node["history_kb"].as<uint32_t>();
+			if (node["global_rate_limit"])
+				rhs.global_rate_limit = node["global_rate_limit"].as<uint32_t>();
 			return true;
 		}
 	};
@@ -131,10 +259,32 @@ namespace YAML {
 			node["allowed"] = rhs.allowed;
 			node["blocked"] = rhs.blocked;
 			node["notify"] = rhs.notify;
+			node["colors"] = rhs.colors;
+			node["exclude_colors"] = rhs.exclude_colors;
 			node["prefix"] = rhs.prefix;
 			node["send_connected"] = rhs.send_connected;
 			node["allow_commands"] = rhs.allow_commands;
 			node["show_command_response"] = rhs.show_command_response;
+			node["rolling"] = rhs.rolling;
+			node["rolling_per_filter"] = rhs.rolling_per_filter;
+			node["rolling_interval"] = rhs.rolling_interval;
+			node["embeds"] = rhs.embeds;
+			node["embed_color"] = rhs.embed_color;
+			node["attachment_threshold"] = rhs.attachment_threshold;
+			node["attachment_compress"] = rhs.attachment_compress;
+			node["dedup"] = rhs.dedup;
+			node["dedup_window"] = rhs.dedup_window;
+			node["rollup"] = rhs.rollup;
+			node["rollup_key"] = rhs.rollup_key;
+			node["rollup_value"] = rhs.rollup_value;
+			node["rollup_interval"] = rhs.rollup_interval;
+			node["rollup_top"] = rhs.rollup_top;
+			node["rollup_capacity"] = rhs.rollup_capacity;
+			node["transport"] = rhs.transport;
+			node["transport_target"] = rhs.transport_target;
+			node["transport_max_size"] = rhs.transport_max_size;
+			node["transport_keep"] = rhs.transport_keep;
+			node["weight"] = rhs.weight;
 			return node;
 		}
 
@@ -142,12 +292,16 @@ namespace YAML {
 			rhs.id = node["id"].as<std::string>();
 			if (node["name"])
 				rhs.name = node["name"].as<std::string>();
-			if (node["allowed"])
+			if (node["allowed"] && node["allowed"].IsSequence())
 				rhs.allowed = node["allowed"].as<std::vector<std::string>>();
-			if (node["blocked"])
+			if (node["blocked"] && node["blocked"].IsSequence())
 				rhs.blocked = node["blocked"].as<std::vector<std::string>>();
-			if (node["notify"])
+			if (node["notify"] && node["notify"].IsSequence())
 				rhs.notify = node["notify"].as<std::vector<std::string>>();
+			if (node["colors"] && node["colors"].IsSequence())
+				rhs.colors = node["colors"].as<std::vector<std::string>>();
+			if (node["exclude_colors"] && node["exclude_colors"].IsSequence())
+				rhs.exclude_colors = node["exclude_colors"].as<std::vector<std::string>>();
 			if (node["prefix"])
 				rhs.prefix = node["prefix"].as<std::string>();
 			if (node["send_connected"])
@@ -156,6 +310,46 @@ namespace YAML {
 				rhs.allow_commands = node["allow_commands"].as<bool>();
 			if (node["show_command_response"])
 				rhs.show_command_response = node["show_command_response"].as<uint32_t>();
+			if (node["rolling"])
+				rhs.rolling = node["rolling"].as<bool>();
+			if (node["rolling_per_filter"])
+				rhs.rolling_per_filter = node["rolling_per_filter"].as<bool>();
+			if (node["rolling_interval"])
+				rhs.rolling_interval = node["rolling_interval"].as<uint32_t>();
+			if (node["embeds"])
+				rhs.embeds = node["embeds"].as<bool>();
+			if (node["embed_color"])
+				rhs.embed_color = node["embed_color"].as<uint32_t>();
+			if (node["attachment_threshold"])
+				rhs.attachment_threshold = node["attachment_threshold"].as<uint32_t>();
+			if (node["attachment_compress"])
+				rhs.attachment_compress = node["attachment_compress"].as<bool>();
+			if (node["dedup"])
+				rhs.dedup = node["dedup"].as<bool>();
+			if (node["dedup_window"])
+				rhs.dedup_window = node["dedup_window"].as<uint32_t>();
+			if (node["rollup"])
+				rhs.rollup = node["rollup"].as<bool>();
+			if (node["rollup_key"])
+				rhs.rollup_key = node["rollup_key"].as<std::string>();
+			if (node["rollup_value"])
+				rhs.rollup_value = node["rollup_value"].as<std::string>();
+			if (node["rollup_interval"])
+				rhs.rollup_interval = node["rollup_interval"].as<uint32_t>();
+			if (node["rollup_top"])
+				rhs.rollup_top = node["rollup_top"].as<uint32_t>();
+			if (node["rollup_capacity"])
+				rhs.rollup_capacity = node["rollup_capacity"].as<uint32_t>();
+			if (node["transport"])
+				rhs.transport = node["transport"].as<std::string>();
+			if (node["transport_target"])
+				rhs.transport_target = node["transport_target"].as<std::string>();
+			if (node["transport_max_size"])
+				rhs.transport_max_size = node["transport_max_size"].as<uint32_t>();
+			if (node["transport_keep"])
+				rhs.transport_keep = node["transport_keep"].as<uint32_t>();
+			if (node["weight"])
+				rhs.weight = node["weight"].as<uint32_t>();
 			return true;
 		}
 	};
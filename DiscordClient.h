@@ -8,13 +8,31 @@
 #include <vector>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <future>
+#include <limits>
+#include <bitset>
+#include <random>
+#include <filesystem>
+#include <fstream>
 
 #pragma warning(push)
 #pragma warning(disable: 4267)
 #include <sleepy_discord\sleepy_discord.h>
+#include <asio.hpp>
 #pragma warning(pop)
 
 #include "Config.h"
+#include "Gateway.h"
+#include "GatewaySession.h"
+#include "LruCache.h"
+#include "SharedDedup.h"
+#include "Rollup.h"
+#include "Transport.h"
+#include "Trace.h"
+#include "Regex.h"
+#include "ChatHistory.h"
+#include "Scheduler.h"
 #include "Blech/Blech.h"
 
 unsigned int __stdcall MQ2DataVariableLookup(char * VarName, char * Value, size_t ValueLen);
@@ -29,39 +47,226 @@ namespace MQ2Discord
 		Notify
 	};
 
+	/// How a line matched one channel's filters
+	struct ChannelVerdict
+	{
+		FilterMatch match = FilterMatch::None;
+
+		/// The allow/notify filter that matched, used to key rolling messages per filter
+		const std::string * filter = nullptr;
+
+		bool operator==(const ChannelVerdict& other) const
+		{
+			return match == other.match && filter == other.filter;
+		}
+	};
+
+	/// Which filters a line is matched against, so the cheap, important part can run now and the rest later when time is short
+	enum class MatchScope
+	{
+		/// Everything
+		All,
+		/// Only block and notify filters, of channels that have notify filters
+		Priority,
+		/// Everything except notifications, for a line that's already been through a Priority match
+		Deferred
+	};
+
+	/// How outgoing messages are spread over the configured tokens
+	enum class TokenAssignment
+	{
+		/// Each channel always uses the same token, picked by hashing the channel id
+		Hash,
+		/// Each send uses whichever token has the most rate limit budget left for that channel
+		Budget
+	};
+
+	/// How a queued line gets to discord
+	enum class SendMode
+	{
+		/// Joined with other lines into plain messages
+		Text,
+		/// Edited into the channel's live message
+		Rolling,
+		/// Packed into embeds, several per message
+		Embed
+	};
+
+	/// One line for several channels. It's queued once, and only split into a line per channel when the background thread drains the queue.
+	struct Broadcast
+	{
+		struct Target
+		{
+			std::string channelId;
+
+			/// Parsed prefix for the channel
+			std::string prefix;
+
+			const ChannelConfig * channel = nullptr;
+			SendMode mode = SendMode::Text;
+			std::string rollingKey;
+		};
+
+		std::string text;
+
+		/// One per channel id. Channels that share an id share a rate limit bucket, and would only post the same line twice.
+		std::vector<Target> targets;
+	};
+
+	/// A line waiting to be sent by the background thread
+	struct QueuedMessage
+	{
+		QueuedMessage() = default;
+		QueuedMessage(std::string channelId, std::string text, const ChannelConfig * channel = nullptr, SendMode mode = SendMode::Text, std::string rollingKey = "")
+			: channelId(std::move(channelId)), text(std::move(text)), channel(channel), mode(mode), rollingKey(std::move(rollingKey)) { }
+
+		std::string channelId;
+		std::string text;
+
+		/// Config of the channel the line is for. Required for anything but plain text.
+		const ChannelConfig * channel = nullptr;
+
+		SendMode mode = SendMode::Text;
+
+		/// Identifies which live message of a rolling channel this line belongs to
+		std::string rollingKey;
+
+		/// When the line reached each stage so far
+		TraceStamps trace{};
+
+		/// If set, this is a broadcast and everything above but the trace is unused
+		std::shared_ptr<const Broadcast> broadcast;
+	};
+
+	/// Lines for one channel waiting to be batched and sent
+	struct PendingLines
+	{
+		const ChannelConfig * channel = nullptr;
+		std::deque<std::string> lines;
+
+		/// Stamps of each line, kept in step with lines
+		std::deque<TraceStamps> traces;
+	};
+
+	/// A message that is kept up to date with edits instead of posting new messages
+	struct RollingMessage
+	{
+		std::string channelId;
+		std::string messageId;
+
+		/// Index of the token that posted the message. Bots can only edit their own messages, so edits have to go through the same one.
+		size_t connection = 0;
+
+		/// What the live message currently contains
+		std::string content;
+
+		/// Lines waiting for the next edit
+		std::string pending;
+
+		std::chrono::milliseconds interval{ 0 };
+		std::chrono::steady_clock::time_point lastUpdate;
+
+		/// Updates that have failed in a row. Each one doubles the wait before the next try, up to 16 intervals.
+		uint32_t failures = 0;
+
+		/// When the next update is allowed
+		std::chrono::steady_clock::time_point nextUpdate() const
+		{
+			return lastUpdate + interval * (1 << std::min(failures, 4u));
+		}
+	};
+
 	class DiscordClient
 	{
 	public:
-		DiscordClient(std::string token,
+		DiscordClient(std::vector<std::string> tokens,
+			TokenAssignment tokenAssignment,
+			uint32_t globalRateLimit,
 			std::vector<std::string> userIds,
 			std::vector<ChannelConfig> channels,
-			std::function<void(std::string command)> executeCommand,
+			size_t verdictCacheSize,
+			uint32_t verdictCacheVerify,
+			std::string sessionName,
+			std::string sessionDirectory,
+			std::shared_ptr<ChatHistory> history,
+			std::function<void(std::vector<std::string> commands, std::function<void()> done)> executeCommands,
 			std::function<std::string(std::string input)> parseMacroData,
 			void(*writeError)(const char * format, ...),
 			void(*writeWarning)(const char * format, ...),
 			void(*writeNormal)(const char * format, ...),
 			void(*writeDebug)(const char * format, ...))
-			: _token(std::move(token)), _userIds(std::move(userIds)), _channels(std::move(channels)), _parseMacroData(std::move(parseMacroData)),
-			_executeCommand(std::move(executeCommand)), _writeError(writeError), _writeWarning(writeWarning), _writeNormal(writeNormal), _writeDebug(writeDebug), _stop(false),
-			_blech('#', '|', MQ2DataVariableLookup)
+			: _tokens(std::move(tokens)), _tokenAssignment(tokenAssignment), _globalRateLimit(globalRateLimit), _health(_tokens.size()), _userIds(std::move(userIds)), _channels(std::move(channels)), _parseMacroData(std::move(parseMacroData)),
+			_executeCommands(std::move(executeCommands)), _writeError(writeError), _writeWarning(writeWarning), _writeNormal(writeNormal), _writeDebug(writeDebug), _stop(false),
+			_stableFilters(this), _volatileFilters(this), _priorityFilters(this), _verdictCacheVerify(verdictCacheVerify), _normalizeDigits(true),
+			_sessionName(std::move(sessionName)), _sessionDirectory(std::move(sessionDirectory)), _history(std::move(history))
 		{
-			// Add events to the parser and store the id/channel in the appropriate map
-			for (auto channelIt = _channels.begin(); channelIt != _channels.end(); ++channelIt)
+			// Add events to the parsers. Filters that use MQ variables can match differently from one moment to the next, so those channels
+			// get their own parser that's always run. Everything else only depends on the line, so its results can be cached.
+			// Rollups need the values captured from every line, which a cached verdict doesn't have, so they're never cached either.
+			_rollups.resize(_channels.size());
+			for (size_t i = 0; i < _channels.size(); ++i)
 			{
-				for (auto allow : channelIt->allowed)
-					_blechAllowEvents[_blech.AddEvent(allow.c_str(), blechMatch, this)] = &(*channelIt);
-				for (auto block : channelIt->blocked)
-					_blechBlockEvents[_blech.AddEvent(block.c_str(), blechMatch, this)] = &(*channelIt);
-				for (auto notify : channelIt->notify)
-					_blechNotifyEvents[_blech.AddEvent(notify.c_str(), blechMatch, this)] = &(*channelIt);
+				if (!_channels[i].notify.empty())
+					_priorityFilters.add(_channels[i], i, true);
+
+				if (_channels[i].rollup)
+				{
+					_rollups[i] = std::make_unique<ChannelRollup>(_channels[i]);
+					_volatileFilters.add(_channels[i], i);
+					continue;
+				}
+
+				if (usesVariables(_channels[i]))
+				{
+					_volatileFilters.add(_channels[i], i);
+					continue;
+				}
+
+				_stableFilters.add(_channels[i], i);
+
+				// Numbers can only be replaced with a placeholder if no filter has a digit outside of a #...# token
+				// A regular expression can tell digit runs apart in too many ways to check, e.g. \d{3}, so it always turns this off
+				for (const auto * filters : { &_channels[i].allowed, &_channels[i].blocked, &_channels[i].notify })
+					for (const auto& filter : *filters)
+						if (hasLiteralDigit(filter) || RegexSet::isRegexFilter(filter))
+							_normalizeDigits = false;
+			}
+
+			if (verdictCacheSize > 0 && !_stableFilters.empty())
+				_verdictCache = std::make_unique<LruCache<std::vector<ChannelVerdict>>>(verdictCacheSize);
+
+			// Work out which chat colours each channel wants, and which colours any channel wants at all
+			for (const auto& channel : _channels)
+			{
+				ChatColors colors;
+				if (channel.colors.empty())
+					colors.set();
+				for (const auto& color : channel.colors)
+					setColor(colors, color, true);
+				for (const auto& color : channel.exclude_colors)
+					setColor(colors, color, false);
+
+				_channelColors.push_back(colors);
+				_acceptedColors |= colors;
+			}
+
+			// Only map the shared dedup table if something uses it
+			if (std::any_of(_channels.begin(), _channels.end(), [](const ChannelConfig& channel) { return channel.dedup; }))
+			{
+				_dedup = std::make_unique<SharedDedup>();
+				if (!_dedup->isValid())
+					_writeWarning("Couldn't open the shared dedup table, every box will send its own copy of dedup channels' lines");
 			}
 
 			// Create background thread, this starts it too
 			_thread = std::thread{ &DiscordClient::threadStart, this };
 
+			auto connected = std::make_shared<Broadcast>();
+			connected->text = "Connected";
 			for (const auto &channel : _channels)
 				if (channel.send_connected)
-					enqueue(channel.id, "Connected");
+					addTarget(*connected, { channel.id, "", &channel, sendMode(channel), "channel" });
+			enqueueBroadcast(std::move(connected));
 		}
 
 		~DiscordClient()
@@ -72,18 +277,122 @@ namespace MQ2Discord
 			_writeDebug("Thread Joined");
 		}
 
-		/// Queue a message to be sent on all channels
+		/// Queue a message to be sent on all channels, as a single broadcast. Each different prefix is only parsed once.
 		void enqueueAll(std::string message)
 		{
-			std::lock_guard<std::mutex> lock(_messagesMutex);
-			for (auto channel : _channels)
-				_messages.emplace(channel.id, _parseMacroData(channel.prefix) + message);
+			auto broadcast = std::make_shared<Broadcast>();
+			broadcast->text = std::move(message);
+
+			std::map<std::string, std::string> prefixes;
+			for (const auto& channel : _channels)
+			{
+				auto prefix = prefixes.find(channel.prefix);
+				if (prefix == prefixes.end())
+					prefix = prefixes.emplace(channel.prefix, _parseMacroData(channel.prefix)).first;
+				addTarget(*broadcast, { channel.id, prefix->second });
+			}
+			enqueueBroadcast(std::move(broadcast));
+		}
+
+		/// Run any MQ evaluations queued by the background thread, and hand the results back. Must be called from the main thread.
+		void processEvaluations()
+		{
+			std::queue<Evaluation> evaluations;
+			{
+				std::lock_guard<std::mutex> lock(_evaluationsMutex);
+				if (_evaluations.empty())
+					return;
+				std::swap(evaluations, _evaluations);
+			}
+
+			while (!evaluations.empty())
+			{
+				auto& evaluation = evaluations.front();
+				evaluation.callback(_parseMacroData(evaluation.input));
+				evaluations.pop();
+			}
 		}
 
+		/// Post the summary of any rollup channel whose interval is up. Call from the main thread.
+		void postRollups()
+		{
+			const auto now = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < _rollups.size(); ++i)
+			{
+				auto * rollup = _rollups[i].get();
+				if (!rollup || now < rollup->nextPost)
+					continue;
+
+				const auto& channel = _channels[i];
+				rollup->nextPost = now + std::chrono::milliseconds(channel.rollup_interval);
+				if (rollup->rollup.events() == 0)
+					continue;
+
+				std::string summary = std::to_string(rollup->rollup.events()) + " events";
+				if (!channel.rollup_value.empty())
+					summary += ", " + formatTotal(rollup->rollup.sum()) + " " + escapeFor(channel, channel.rollup_value);
+				summary += " in the last " + std::to_string(channel.rollup_interval / 1000) + "s";
+
+				size_t rank = 0;
+				for (const auto& entry : rollup->rollup.top(channel.rollup_top))
+				{
+					summary += "\n" + std::to_string(++rank) + ". " + escapeFor(channel, entry.key) + ": " + formatTotal(entry.total);
+					if (entry.error > 0)
+						summary += " (at most " + formatTotal(entry.error) + " over)";
+				}
+
+				rollup->rollup.clear();
+				enqueue(channel.id, _parseMacroData(channel.prefix) + summary, &channel, sendMode(channel), "channel");
+			}
+		}
+
+		/// Lines describing how the client is doing, for /discord stats
+		std::vector<std::string> stats() const
+		{
+			std::vector<std::string> results;
+			for (size_t i = 0; i < _health.size(); ++i)
+			{
+				const int64_t rtt = _health[i].heartbeatRtt;
+				results.push_back("Gateway " + std::to_string(i) + ": heartbeat " + (rtt < 0 ? std::string("n/a") : std::to_string(rtt) + "ms")
+					+ ", " + std::to_string(_health[i].reconnects) + " reconnects");
+			}
+			const size_t batches = _backlogBatches;
+			if (batches == 0)
+				results.push_back("Send queue: empty");
+			else
+			{
+				const int64_t tenths = _backlogDrainMs / 100;
+				results.push_back("Send queue: " + std::to_string(batches) + " batches, all sent in about " + std::to_string(tenths / 10) + "." + std::to_string(tenths % 10) + "s");
+			}
+			for (auto& line : _tracer.stats())
+				results.push_back(std::move(line));
+			return results;
+		}
+
+		/// The last few relayed lines as a Chrome trace, for /discord trace
+		std::string traceJson() const
+		{
+			return _tracer.chromeTrace();
+		}
+
+		/// How long a stopped client keeps trying to send what's left in its queue
+		static constexpr std::chrono::milliseconds ShutdownTimeout{ 3000 };
+
+		/// Ask the background thread to finish up. Doesn't wait for it.
 		void Stop()
 		{
+			if (_stop.exchange(true))
+				return;
+
 			_writeDebug("Stopping discord thread");
-			_stop = true;
+			_stopDeadline = std::chrono::steady_clock::now() + ShutdownTimeout;
+
+			// Cancel the timers from the loop's own thread. Once nothing is left to do, the loop returns and the thread finishes up.
+			asio::post(_io, [this]() {
+				_flushTimer.cancel();
+				_healthTimer.cancel();
+				_syncTimer.cancel();
+			});
 		}
 
 		bool IsStopped()
@@ -91,42 +400,108 @@ namespace MQ2Discord
 			return _stopped;
 		}
 
-		/// Queue a message to be sent on any channel with matching filters
-		void enqueueIfMatch(std::string message)
+		/// Whether any channel could want a line of this chat colour. Lines that no channel wants can be thrown away before doing anything else.
+		bool acceptsColor(int color) const
+		{
+			if (color < 0 || static_cast<size_t>(color) >= _acceptedColors.size() || _acceptedColors.test(color))
+				return true;
+
+			// Anything goes while a channel is showing the response to a command
+			return std::chrono::steady_clock::now().time_since_epoch().count() < _responseWindowEnd;
+		}
+
+		/// Queue a message to be sent on any channel with matching filters. A negative colour matches any channel.
+		/// hookTime is when the line reached the plugin, from LatencyTracer::now(), for tracing its latency.
+		void enqueueIfMatch(std::string message, int color = -1, MatchScope scope = MatchScope::All, uint64_t hookTime = 0)
 		{
 			// Clear results & set every channel to no match initially
-			_filterMatches.clear();
-			for (const auto& _channel : _channels)
-				_filterMatches[&_channel] = FilterMatch::None;
+			_filterMatches.assign(_channels.size(), ChannelVerdict());
 
-			// Feed the message through the parser. Colour codes are removed beforehand.
+			// Feed the message through the parsers. Colour codes are removed beforehand.
 			char buffer[2048] = { 0 };
 			strcpy_s(buffer, std::regex_replace(message, std::regex("\a\\-?."), "").c_str());
-			_blech.Feed(buffer);
+			if (scope == MatchScope::Priority)
+			{
+				if (_priorityFilters.empty())
+					return;
+				_priorityFilters.feed(buffer);
+			}
+			else
+			{
+				matchStableFilters(buffer);
+				if (!_volatileFilters.empty())
+					_volatileFilters.feed(buffer);
+			}
+
+			TraceStamps trace{};
+			if (hookTime != 0)
+			{
+				trace[static_cast<size_t>(TraceStage::Hook)] = hookTime;
+				LatencyTracer::stamp(trace, TraceStage::Matched);
+			}
 
 			// Send to any channels that matched
-			for (auto kvp : _filterMatches)
+			for (size_t i = 0; i < _channels.size(); ++i)
 			{
-				if (kvp.first)
+				const auto * channel = &_channels[i];
+				const auto& verdict = _filterMatches[i];
+
+				// A priority match only sends notifications, and the deferred match for the same line leaves them out
+				if ((scope == MatchScope::Priority && verdict.match != FilterMatch::Notify) || (scope == MatchScope::Deferred && verdict.match == FilterMatch::Notify))
+					continue;
+
+				const bool colorAccepted = color < 0 || static_cast<size_t>(color) >= _channelColors[i].size() || _channelColors[i].test(color);
+
+				const bool showResponse = channel->show_command_response > 0
+					&& _responseExpiryTimes.find(channel) != _responseExpiryTimes.end()
+					&& _responseExpiryTimes[channel] > std::chrono::system_clock::now();
+
+				// Rollup channels add allowed lines to their totals instead of sending them. Notifications still go out as they happen.
+				if (auto * rollup = _rollups[i].get())
 				{
-					if ((kvp.first->show_command_response > 0
-							&& _responseExpiryTimes.find(kvp.first) != _responseExpiryTimes.end()
-							&& _responseExpiryTimes[kvp.first] > std::chrono::system_clock::now())
-						|| kvp.second == FilterMatch::Allow)
-					{
-						enqueue(kvp.first->id, _parseMacroData(kvp.first->prefix) + escape_discord(message));
-					}
-					else if (kvp.second == FilterMatch::Notify)
+					const bool captured = rollup->captured;
+					rollup->captured = false;
+					if (!showResponse && verdict.match == FilterMatch::Allow)
 					{
-						enqueue(kvp.first->id, _parseMacroData(kvp.first->prefix) + escape_discord(message) + " @everyone");
+						if (captured && colorAccepted)
+							rollup->rollup.add(std::move(rollup->key), rollup->value);
+						continue;
 					}
 				}
+
+				// Another box on this machine has already sent this line. Command responses are always our own, so they're never skipped.
+				if (!showResponse && colorAccepted && channel->dedup && _dedup
+					&& (verdict.match == FilterMatch::Allow || verdict.match == FilterMatch::Notify)
+					&& !_dedup->claim(buffer, channel->id, SharedDedup::bucket(channel->dedup_window)))
+				{
+					continue;
+				}
+
+				// Rolling channels keep one live message per channel, or per matching filter
+				const std::string rollingKey = channel->rolling_per_filter && verdict.filter ? "filter " + *verdict.filter : "channel";
+
+				if (showResponse || (verdict.match == FilterMatch::Allow && colorAccepted))
+				{
+					enqueue(channel->id, _parseMacroData(channel->prefix) + escapeFor(*channel, message), channel, sendMode(*channel), rollingKey, trace);
+				}
+				else if (verdict.match == FilterMatch::Notify && colorAccepted)
+				{
+					// Notifications are always a new plain message, an edit or an embed wouldn't ping anybody. Only discord has anybody to ping.
+					const auto mention = channel->transport == "discord" ? " @everyone" : "";
+					enqueue(channel->id, _parseMacroData(channel->prefix) + escapeFor(*channel, message) + mention, nullptr, SendMode::Text, "", trace);
+				}
 			}
 		}
 
 	private:
-		/// Discord API token
-		const std::string _token;
+		/// Discord API tokens. Each one gets its own connection and rate limit state.
+		const std::vector<std::string> _tokens;
+
+		/// How outgoing messages are spread over the tokens
+		const TokenAssignment _tokenAssignment;
+
+		/// Requests per second each token may make across every channel, 0 for no limit
+		const uint32_t _globalRateLimit;
 
 		/// List of user ids allowed to issue commands
 		const std::vector<std::string> _userIds;;
@@ -134,11 +509,54 @@ namespace MQ2Discord
 		/// List of configured channels to send/receive messages to/from
 		const std::vector<ChannelConfig> _channels;
 
-		/// Function to parse a string containing MQ2 variables
+		/// Function to parse a string containing MQ2 variables. Touches game state, so only call it from the main thread.
 		const std::function<std::string(std::string input)> _parseMacroData;
 
-		/// Function to execute an ingame command. Must be threadsafe as it won't be invoked from the main thread
-		const std::function<void(std::string command)> _executeCommand;
+		/// Text to parse on the main thread, and what to do with the result
+		struct Evaluation
+		{
+			std::string input;
+			std::function<void(std::string result)> callback;
+		};
+
+		/// Evaluations waiting for the main thread
+		std::queue<Evaluation> _evaluations;
+
+		/// Sync mutex for access to _evaluations
+		std::mutex _evaluationsMutex;
+
+		/// Queue some text to be parsed on the main thread. The callback is run on the main thread with the result.
+		void evaluate(std::string input, std::function<void(std::string result)> callback)
+		{
+			std::lock_guard<std::mutex> lock(_evaluationsMutex);
+			_evaluations.push({ std::move(input), std::move(callback) });
+		}
+
+		/// Queue a reply on a channel, with the channel's prefix parsed on the main thread
+		void reply(const ChannelConfig& channel, std::string message)
+		{
+			evaluate(channel.prefix, [this, channelId = channel.id, message = std::move(message)](std::string prefix) {
+				enqueue(channelId, prefix + message);
+			});
+		}
+
+		/// Function to queue a batch of ingame commands to run in order, calling done on the main thread once they have.
+		/// Must be threadsafe as it won't be invoked from the main thread
+		const std::function<void(std::vector<std::string> commands, std::function<void()> done)> _executeCommands;
+
+		/// Batches whose commands have all run, waiting to be acknowledged with a reaction. Shared with the done callbacks, which can
+		/// outlive the client if it's reloaded mid-batch.
+		struct CommandAcks
+		{
+			std::mutex mutex;
+
+			/// Channel id and message id of each finished batch
+			std::vector<std::pair<std::string, std::string>> pending;
+		};
+		std::shared_ptr<CommandAcks> _commandAcks = std::make_shared<CommandAcks>();
+
+		/// Reaction added to a batch of commands once it's finished, URL encoded ✅
+		static constexpr const char * BatchDoneReaction = "%E2%9C%85";
 
 		/// Function to write an error message to ingame chat. Must be threadsafe
 		void(*const _writeError)(const char * format, ...);
@@ -155,78 +573,545 @@ namespace MQ2Discord
 		/// Background thread to handle discord communications. Will run for the lifetime of this class
 		std::thread _thread;
 
+		/// Event loop for the background thread. Sends, retries and timers all run on it.
+		asio::io_context _io;
+
+		/// Sends whatever is queued, at FlushInterval or sooner when a rate limit resets or a rolling message is due
+		asio::steady_timer _flushTimer{ _io };
+
+		/// Checks the connections are still getting heartbeat acks
+		asio::steady_timer _healthTimer{ _io };
+
+		/// Has the local sinks make what they've written so far durable
+		asio::steady_timer _syncTimer{ _io };
+
+		/// How often queued messages are sent when nothing else needs doing sooner
+		static constexpr std::chrono::milliseconds FlushInterval{ 1000 };
+
+		/// How often to check the connections' heartbeats
+		static constexpr std::chrono::seconds HealthCheckInterval{ 1 };
+
+		/// How often the local sinks sync, i.e. at most how much of a file sink is lost if the game crashes
+		static constexpr std::chrono::seconds SinkSyncInterval{ 1 };
+
+		/// Reconnect backoff starts here and doubles each consecutive attempt, up to the maximum
+		static constexpr std::chrono::milliseconds ReconnectBackoff{ 1000 };
+		static constexpr std::chrono::milliseconds MaxReconnectBackoff{ 60000 };
+
 		/// Stop signal	for the background thread
 		std::atomic<bool> _stop;
 
 		/// Determine if the thread is actually stopped.
-		std::atomic<bool> _stopped;
+		std::atomic<bool> _stopped{ false };
+
+		/// Once stopped, when to give up on sending anything else
+		std::atomic<std::chrono::steady_clock::time_point> _stopDeadline{ std::chrono::steady_clock::time_point::max() };
+
+		/// Whether the client has been stopped and run out of time to send things
+		bool pastStopDeadline() const
+		{
+			return _stop && std::chrono::steady_clock::now() > _stopDeadline.load();
+		}
 
-		/// Queue of messages to send to discord. Tuple of channelId, messageText
-		std::queue<std::tuple<std::string, std::string>> _messages;
+		/// Queue of messages to send to discord
+		std::queue<QueuedMessage> _messages;
 
 		/// Sync mutex for access to _messages
 		std::mutex _messagesMutex;
 
-		/// Parser to match chat text to channels based on allow/block filters
-		Blech _blech;
+		/// A filter that a Blech event was created from
+		struct FilterEvent
+		{
+			/// Index into _channels
+			size_t channel;
+			const std::string * filter;
+		};
+
+		/// A channel's re: filters, all compiled into one automaton
+		struct ChannelRegex
+		{
+			/// Index into _channels
+			size_t channel;
+			RegexSet regex;
+
+			/// What kind of filter each pattern in regex came from, and the filter itself
+			std::vector<std::pair<FilterMatch, const std::string *>> filters;
+
+			/// Scratch space for the patterns that matched a line
+			std::vector<bool> matches;
+		};
+
+		/// A parser to match chat text to channels based on allow/block filters, and which channel/filter each of its events came from.
+		/// Blech filters are events of one parser, and re: filters are run separately per channel.
+		struct FilterSet
+		{
+			explicit FilterSet(DiscordClient * client) : client(client), blech('#', '|', MQ2DataVariableLookup) { }
+
+			DiscordClient * const client;
+			Blech blech;
+
+			/// Mapping from Blech event ID to channel for all allow events
+			std::map<unsigned int, FilterEvent> allowEvents;
+
+			/// Mapping from Blech event ID to channel for all block events
+			std::map<unsigned int, FilterEvent> blockEvents;
+
+			/// Mapping from Blech event ID to channel for all notify events
+			std::map<unsigned int, FilterEvent> notifyEvents;
+
+			/// re: filters of each channel that has them
+			std::vector<ChannelRegex> regexes;
+
+			/// Add events for all of a channel's filters, or just its block and notify filters
+			void add(const ChannelConfig& channel, size_t index, bool notifyOnly = false)
+			{
+				const auto addFilters = [&](const std::vector<std::string>& filters, FilterMatch match, std::map<unsigned int, FilterEvent>& events) {
+					for (const auto& filter : filters)
+					{
+						if (RegexSet::isRegexFilter(filter))
+							addRegex(index, match, filter);
+						else
+							events[blech.AddEvent(filter.c_str(), blechMatch, this)] = { index, &filter };
+					}
+				};
+
+				if (!notifyOnly)
+					addFilters(channel.allowed, FilterMatch::Allow, allowEvents);
+				addFilters(channel.blocked, FilterMatch::Block, blockEvents);
+				addFilters(channel.notify, FilterMatch::Notify, notifyEvents);
+			}
+
+			/// Run a line through the Blech parser and every channel's regular expressions
+			void feed(char * buffer)
+			{
+				if (!allowEvents.empty() || !blockEvents.empty() || !notifyEvents.empty())
+					blech.Feed(buffer);
+
+				for (auto& regex : regexes)
+				{
+					if (!regex.regex.match(buffer, regex.matches))
+						continue;
+					for (size_t i = 0; i < regex.matches.size(); ++i)
+						if (regex.matches[i])
+							client->markMatch(regex.channel, regex.filters[i].first, regex.filters[i].second, nullptr);
+				}
+			}
+
+			bool empty() const
+			{
+				return allowEvents.empty() && blockEvents.empty() && notifyEvents.empty() && regexes.empty();
+			}
+
+		private:
+			/// Add a re: filter to the channel's automaton. Filters are checked when the config's loaded, so one that doesn't compile is just skipped.
+			void addRegex(size_t index, FilterMatch match, const std::string& filter)
+			{
+				if (regexes.empty() || regexes.back().channel != index)
+					regexes.push_back({ index });
+
+				auto& regex = regexes.back();
+				std::string error;
+				if (regex.regex.add(filter.substr(strlen(RegexSet::FilterPrefix)), error))
+					regex.filters.emplace_back(match, &filter);
+				else
+					client->_writeError("Skipping filter \ay%s\ax: %s", filter.c_str(), error.c_str());
+			}
+		};
+
+		/// Filters for channels whose results only depend on the line itself
+		FilterSet _stableFilters;
+
+		/// Filters for channels that use MQ variables, which are never cached
+		FilterSet _volatileFilters;
+
+		/// Block and notify filters of every channel with notify filters, for when there's only time to check for notifications
+		FilterSet _priorityFilters;
+
+		/// Verdict per channel, indexed the same as _channels. Cleared before parsing, and populated by the blech match callback.
+		std::vector<ChannelVerdict> _filterMatches;
+
+		/// Normalized line -> verdicts of the stable filters. Null if disabled.
+		std::unique_ptr<LruCache<std::vector<ChannelVerdict>>> _verdictCache;
+
+		/// Cross check one in this many cache hits against the full parser. 0 to never check.
+		const uint32_t _verdictCacheVerify;
+
+		/// Totals for a rollup channel, and the values captured from the line currently being matched
+		struct ChannelRollup
+		{
+			explicit ChannelRollup(const ChannelConfig& channel)
+				: config(channel), rollup(channel.rollup_capacity), nextPost(std::chrono::steady_clock::now() + std::chrono::milliseconds(channel.rollup_interval))
+			{
+			}
+
+			const ChannelConfig& config;
+			Rollup rollup;
+			std::chrono::steady_clock::time_point nextPost;
+
+			/// Set by the blech callback when an allow filter matches, and used once the line's final verdict is known
+			bool captured = false;
+			std::string key;
+			double value = 0;
+
+			/// Pick the key and value out of a match's #...# values. Without rollup_key the filter itself is the key,
+			/// and without rollup_value every line counts as one.
+			void capture(const std::string& filter, PBLECHVALUE values)
+			{
+				key = config.rollup_key.empty() ? filter : std::string();
+				value = config.rollup_value.empty() ? 1 : 0;
+				bool haveValue = config.rollup_value.empty();
+				for (auto * v = values; v; v = v->pNext)
+				{
+					const std::string name = v->Name;
+					if (name == config.rollup_key)
+						key = v->Value;
+					else if (name == config.rollup_value)
+						haveValue = parseNumber(v->Value, value);
+				}
+				captured = haveValue && !key.empty();
+			}
+
+			/// Numbers in chat can have thousands separators, e.g. "1,234 points of damage"
+			static bool parseNumber(const std::string& text, double& result)
+			{
+				std::string digits;
+				for (auto c : text)
+					if (c != ',')
+						digits.push_back(c);
+				char * end = nullptr;
+				result = strtod(digits.c_str(), &end);
+				return end != digits.c_str();
+			}
+		};
+
+		/// Rollup state per channel, indexed the same as _channels. Null for channels that aren't rollups. Only used from the main thread.
+		std::vector<std::unique_ptr<ChannelRollup>> _rollups;
+
+		/// A rollup total as text, without decimals if it's a whole number
+		static std::string formatTotal(double total)
+		{
+			char buffer[32];
+			if (total == static_cast<double>(static_cast<int64_t>(total)))
+				snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(total));
+			else
+				snprintf(buffer, sizeof(buffer), "%.2f", total);
+			return buffer;
+		}
+
+		/// Lines recently sent by any box on this machine, for dedup channels. Null if no channel uses it.
+		std::unique_ptr<SharedDedup> _dedup;
 
-		/// Mapping from Blech event ID to channel for all allow events
-		std::map<unsigned int, const ChannelConfig *> _blechAllowEvents;
+		/// Whether numbers can be replaced with a placeholder in cache keys, which is only safe if no filter has a digit in it
+		bool _normalizeDigits;
 
-		/// Mapping from Blech event ID to channel for all block events
-		std::map<unsigned int, const ChannelConfig *> _blechBlockEvents;
+		/// Reused buffer for the normalized line
+		std::string _normalizedLine;
 
-		/// Mapping from Blech event ID to channel for all notify events
-		std::map<unsigned int, const ChannelConfig *> _blechNotifyEvents;
+		/// Verdict cache counters
+		uint64_t _verdictCacheHits = 0;
+		uint64_t _verdictCacheMisses = 0;
 
-		/// Channel -> FilterMatch. Cleared before parsing, and populated by the blech match callback.
-		std::map<const ChannelConfig *, FilterMatch> _filterMatches;
+		/// Channel id -> lines waiting to be batched and sent as text. Only accessed from the background thread.
+		std::map<std::string, PendingLines> _pendingLines;
+
+		/// Channel id -> lines waiting to be packed into embeds. Only accessed from the background thread.
+		std::map<std::string, PendingLines> _pendingEmbeds;
+
+		/// Discord's limits on embeds: how many per message, the length of each one's description, and the total length of all of them
+		static constexpr size_t MaxEmbeds = 10;
+		static constexpr size_t MaxEmbedDescription = 4096;
+		static constexpr size_t MaxEmbedsLength = 6000;
+
+		/// Most text that goes into one attachment, comfortably under discord's upload limit even uncompressed
+		static constexpr size_t MaxAttachmentLength = 7 * 1024 * 1024;
+
+		/// Used to give each attachment file a unique name. Only accessed from the background thread.
+		uint32_t _attachmentCount = 0;
+
+		/// Which channel sends next when several are waiting. Only accessed from the background thread.
+		FairQueue _fairQueue;
+
+		/// Batches waiting to be sent after the last flush, and how long until they're predicted to all be gone
+		std::atomic<size_t> _backlogBatches{ 0 };
+		std::atomic<int64_t> _backlogDrainMs{ 0 };
+
+		/// How long relayed lines take to get from the game to discord
+		LatencyTracer _tracer;
+
+		/// "channelId|key" -> live rolling message. Only accessed from the background thread.
+		std::map<std::string, RollingMessage> _rollingMessages;
+
+		/// Discord's maximum message length
+		static constexpr size_t MaxMessageLength = 2000;
+
+		/// Set of chat colours, indexed by colour number
+		using ChatColors = std::bitset<1024>;
+
+		/// Colours each channel accepts, indexed the same as _channels
+		std::vector<ChatColors> _channelColors;
+
+		/// Colours accepted by at least one channel
+		ChatColors _acceptedColors;
+
+		/// Latest end of any channel's command response window, in steady_clock ticks. Lets acceptsColor check it without a lock.
+		std::atomic<int64_t> _responseWindowEnd{ 0 };
+
+		/// Include or exclude a colour from a set. Colour names are converted to numbers before the config gets here.
+		static void setColor(ChatColors& colors, const std::string& color, bool value)
+		{
+			try
+			{
+				const auto number = std::stoi(color);
+				if (number >= 0 && static_cast<size_t>(number) < colors.size())
+					colors.set(number, value);
+			}
+			catch (...) { }
+		}
 
 		/// Channel -> Time to stop sending everything in response to a command
 		std::map<const ChannelConfig *, std::chrono::time_point<std::chrono::system_clock>> _responseExpiryTimes;
 
 		/// Queue a message to be sent on a specific channel
-		void enqueue(const std::string& channelId, const std::string& message)
+		void enqueue(const std::string& channelId, const std::string& message, const ChannelConfig * channel = nullptr, SendMode mode = SendMode::Text,
+			const std::string& rollingKey = "", const TraceStamps& trace = {})
+		{
+			std::lock_guard<std::mutex> lock(_messagesMutex);
+			_messages.emplace(channelId, message, channel, mode, rollingKey);
+			_messages.back().trace = trace;
+			LatencyTracer::stamp(_messages.back().trace, TraceStage::Enqueued);
+		}
+
+		/// Add a channel to a broadcast, unless another channel with the same id is already getting it
+		static void addTarget(Broadcast& broadcast, Broadcast::Target target)
 		{
+			if (std::none_of(broadcast.targets.begin(), broadcast.targets.end(), [&](const Broadcast::Target& other) { return other.channelId == target.channelId; }))
+				broadcast.targets.push_back(std::move(target));
+		}
+
+		void enqueueBroadcast(std::shared_ptr<const Broadcast> broadcast)
+		{
+			if (broadcast->targets.empty())
+				return;
+
 			std::lock_guard<std::mutex> lock(_messagesMutex);
-			_messages.emplace(channelId, message);
+			_messages.emplace();
+			_messages.back().broadcast = std::move(broadcast);
+			LatencyTracer::stamp(_messages.back().trace, TraceStage::Enqueued);
+		}
+
+		/// Game text as it should appear on a channel. Only discord reads markdown, local sinks get the text as it was.
+		static std::string escapeFor(const ChannelConfig& channel, const std::string& text)
+		{
+			return channel.transport == "discord" ? escape_discord(text) : text;
+		}
+
+		/// How lines that aren't notifications are sent to a channel. Only discord can edit messages or show embeds.
+		static SendMode sendMode(const ChannelConfig& channel)
+		{
+			if (channel.transport != "discord")
+				return SendMode::Text;
+			if (channel.rolling)
+				return SendMode::Rolling;
+			if (channel.embeds)
+				return SendMode::Embed;
+			return SendMode::Text;
 		}
 
 		/// Callback function for blech parser match
 		static void __stdcall blechMatch(unsigned int ID, void * pData, PBLECHVALUE pValues)
 		{
-			auto pClient = reinterpret_cast<DiscordClient *>(pData);
+			auto pFilters = reinterpret_cast<FilterSet *>(pData);
+
+			for (const auto& [match, events] : { std::make_pair(FilterMatch::Block, &pFilters->blockEvents), std::make_pair(FilterMatch::Notify, &pFilters->notifyEvents),
+				std::make_pair(FilterMatch::Allow, &pFilters->allowEvents) })
+			{
+				auto event = events->find(ID);
+				if (event != events->end())
+				{
+					pFilters->client->markMatch(event->second.channel, match, event->second.filter, pValues);
+					return;
+				}
+			}
+		}
+
+		/// Record that one of a channel's filters matched the current line
+		void markMatch(size_t channel, FilterMatch match, const std::string * filter, PBLECHVALUE values)
+		{
+			auto& verdict = _filterMatches[channel];
+			switch (match)
+			{
+			case FilterMatch::Block:
+				// A block wins regardless of what it was before
+				verdict = { FilterMatch::Block, nullptr };
+				break;
+			case FilterMatch::Notify:
+				// Notify unless it's already blocked
+				if (verdict.match != FilterMatch::Block)
+					verdict = { FilterMatch::Notify, filter };
+				break;
+			case FilterMatch::Allow:
+				// Allow unless it's already block or notify, or an earlier allow filter matched
+				if (verdict.match == FilterMatch::None)
+				{
+					verdict = { FilterMatch::Allow, filter };
+					if (auto * rollup = _rollups[channel].get())
+						rollup->capture(*filter, values);
+				}
+				break;
+			default:
+				break;
+			}
+		}
+
+		/// Whether any of a channel's filters look up MQ variables when matching
+		static bool usesVariables(const ChannelConfig& channel)
+		{
+			for (const auto * filters : { &channel.allowed, &channel.blocked, &channel.notify })
+				for (const auto& filter : *filters)
+					if (!RegexSet::isRegexFilter(filter) && (filter.find('|') != std::string::npos || filter.find("${") != std::string::npos))
+						return true;
+			return false;
+		}
 
-			// If it matched a block filter, mark it as blocked regardless of what it was before
-			auto blockEvent = pClient->_blechBlockEvents.find(ID);
-			if (blockEvent != pClient->_blechBlockEvents.end())
+		/// Whether a filter has a digit in its literal text, i.e. outside of #...# tokens
+		static bool hasLiteralDigit(const std::string& filter)
+		{
+			bool inToken = false;
+			for (auto c : filter)
 			{
-				pClient->_filterMatches[blockEvent->second] = FilterMatch::Block;
+				if (c == '#')
+					inToken = !inToken;
+				else if (!inToken && isdigit(static_cast<unsigned char>(c)))
+					return true;
+			}
+			return false;
+		}
+
+		/// Cache key for a line. Every run of digits becomes a single 0 when that's safe, so "hits you for 12 points" and
+		/// "hits you for 345 points" share an entry. Since no filter has a digit outside a wildcard, a wildcard always covers the
+		/// whole run and the parser can't tell the two apart.
+		void normalizeLine(const char * line, std::string& output) const
+		{
+			output.clear();
+			for (auto p = line; *p; ++p)
+			{
+				if (_normalizeDigits && isdigit(static_cast<unsigned char>(*p)))
+				{
+					output.push_back('0');
+					while (isdigit(static_cast<unsigned char>(p[1])))
+						++p;
+				}
+				else
+					output.push_back(*p);
+			}
+		}
+
+		/// Fill in _filterMatches for the stable channels, from the verdict cache if possible
+		void matchStableFilters(char * buffer)
+		{
+			if (_stableFilters.empty())
+				return;
+
+			if (!_verdictCache)
+			{
+				_stableFilters.feed(buffer);
+				return;
+			}
+
+			normalizeLine(buffer, _normalizedLine);
+			auto cached = _verdictCache->find(_normalizedLine);
+			if (!cached)
+			{
+				++_verdictCacheMisses;
+				_stableFilters.feed(buffer);
+				_verdictCache->insert(_normalizedLine, _filterMatches);
 				return;
 			}
 
-			// If it matches a notify, mark it to notify unless it's already blocked
-			auto notifyEvent = pClient->_blechNotifyEvents.find(ID);
-			if (notifyEvent != pClient->_blechNotifyEvents.end() && pClient->_filterMatches[notifyEvent->second] != FilterMatch::Block)
+			++_verdictCacheHits;
+			if (_verdictCacheVerify == 0 || _verdictCacheHits % _verdictCacheVerify != 0)
 			{
-				pClient->_filterMatches[notifyEvent->second] = FilterMatch::Notify;
+				_filterMatches = *cached;
 				return;
 			}
 
-			// Otherwise, it's matched an allow event, so set to allow unless it's already block or notify
-			auto pChannel = pClient->_blechAllowEvents[ID];
-			if (pClient->_filterMatches[pChannel] == FilterMatch::None)
-				pClient->_filterMatches[pChannel] = FilterMatch::Allow;
+			// Safety check, run the full parser and make sure it agrees with the cache. If it doesn't, the normalization is wrong for this
+			// config, so stop using the cache.
+			_stableFilters.feed(buffer);
+			if (_filterMatches != *cached)
+			{
+				_writeWarning("Verdict cache disagreed with filters for \ay%s\aw, disabling the cache", buffer);
+				_verdictCache.reset();
+			}
 		}
 
-		// Real simple client, all it does is invoke a callback when a message is received
+		// Real simple client, all it does is invoke a callback when a message is received.
+		// The gateway connection is zlib-stream compressed, and messages for channels we don't care about are dropped before being deserialized.
 		class CallbackDiscordClient : public SleepyDiscord::DiscordClient {
 		public:
 			using SleepyDiscord::DiscordClient::DiscordClient;
-			CallbackDiscordClient(const std::string& token, std::function<void(SleepyDiscord::Message &)> callback)
+			CallbackDiscordClient(const std::string& token, std::function<void(SleepyDiscord::Message &)> callback, std::function<bool(std::string_view channelId)> wantsChannel,
+				GatewayHealth& health)
 				: SleepyDiscord::DiscordClient(token, SleepyDiscord::USER_CONTROLED_THREADS),
-				_callback(std::move(callback))
+				_callback(std::move(callback)), _wantsChannel(std::move(wantsChannel)), _health(health)
+			{
+			}
+
+			void onHeartbeat() override
+			{
+				_health.sent();
+			}
+
+			void onHeartbeatAck() override
 			{
+				_health.acked();
+			}
+
+			/// Drop the connection and reconnect. Closing with anything but 1000/1001 keeps the session, so the base client RESUMEs it.
+			/// The websocket belongs to the thread running the client, so the reconnect is scheduled onto it rather than done from the caller's.
+			void resumeConnection()
+			{
+				schedule([this]() { reconnect(4900); }, 0);
+			}
+
+			/// Disconnect without ending the session, so the next client can RESUME it. quit() on its own closes with 1000, which ends it,
+			/// so the socket is closed with 4900 here and the base client is told it's already disconnected.
+			void quitKeepingSession()
+			{
+				disconnectWebsocket(4900);
+
+				// isRestarting = false: stop for good rather than reconnecting. isDisconnected = true: the socket's already closed, so don't
+				// close it again with 1000.
+				quit(false, true);
+			}
+
+			/// Pick up a session from an earlier client, before run. The base client only keeps its session id and sequence number from READY,
+			/// and has no other way to set them, so it's given a stand-in READY for the old session, and its first HELLO is answered with a
+			/// RESUME instead of an IDENTIFY. If discord won't resume it, the base client gets an INVALID_SESSION and identifies as usual.
+			/// This relies on how sleepy_discord handles READY: it only stores the session id and sequence, and doesn't use the placeholder user.
+			/// Only valid sessions are restored, which also keeps anything that would need escaping out of the stand-in READY.
+			void restoreSession(const GatewaySession& session)
+			{
+				if (!session.valid())
+					return;
+
+				{
+					std::lock_guard<std::mutex> lock(_sessionMutex);
+					_sessionId = session.sessionId;
+					_resumeUrl = session.resumeUrl;
+				}
+				_sequence = session.sequence;
+
+				SleepyDiscord::DiscordClient::processMessage("{\"op\":0,\"s\":" + std::to_string(session.sequence) + ",\"t\":\"READY\",\"d\":{\"v\":10,"
+					"\"user\":{\"id\":\"0\",\"username\":\"\",\"discriminator\":\"0\",\"bot\":true},\"guilds\":[],\"session_id\":\"" + session.sessionId
+					+ "\",\"resume_gateway_url\":\"" + session.resumeUrl + "\"}}");
+			}
+
+			/// The current session, for the next client to resume
+			GatewaySession session() const
+			{
+				std::lock_guard<std::mutex> lock(_sessionMutex);
+				return { _sessionId, _sequence, _resumeUrl };
 			}
 
 			void onMessage(SleepyDiscord::Message message) override
@@ -234,10 +1119,365 @@ namespace MQ2Discord
 				if (_callback)
 					_callback(message);
 			}
+
+			bool connect(const std::string& uri, SleepyDiscord::GenericMessageReceiver* messageProcessor, SleepyDiscord::WebsocketConnection& connection) override
+			{
+				// Each connection gets a fresh zlib context
+				_inflater.reset();
+
+				// Resumes have to go to the gateway the session came from, with the same query
+				std::string target = uri;
+				{
+					std::lock_guard<std::mutex> lock(_sessionMutex);
+					const auto query = uri.find('?');
+					if (!_sessionId.empty() && !_resumeUrl.empty())
+						target = _resumeUrl + (query == std::string::npos ? "" : (_resumeUrl.back() == '/' ? "" : "/") + uri.substr(query));
+				}
+
+				if (!_inflater.isValid())
+					return SleepyDiscord::DiscordClient::connect(target, messageProcessor, connection);
+				return SleepyDiscord::DiscordClient::connect(target + (target.find('?') == std::string::npos ? "?" : "&") + "compress=zlib-stream", messageProcessor, connection);
+			}
+
+			void processMessage(const std::string& message) override
+			{
+				_bytesReceived += message.size();
+
+				// Anything that isn't compressed (e.g. if compression couldn't be set up) goes straight through
+				const std::string * payload = &message;
+				if (!message.empty() && message.front() != '{')
+				{
+					const auto inflated = _inflater.feed(message, _inflated);
+					if (inflated == InflateResult::Failed)
+					{
+						// Every later frame depends on the context that's been lost, so start a new connection. connect resets the inflater,
+						// and closing with 4900 keeps the session so nothing is missed.
+						reconnect(4900);
+						return;
+					}
+					if (inflated != InflateResult::Complete)
+						return;
+					payload = &_inflated;
+				}
+				_bytesInflated += payload->size();
+
+				// Most guild messages are for channels this character isn't using. Rather than fully deserializing those, hand the base client
+				// a stub so it still tracks the sequence number. Only ids that are plain snowflakes go into the stub, anything else takes the slow path.
+				GatewayPeek peek;
+				if (!GatewayScanner::peek(*payload, peek))
+				{
+					SleepyDiscord::DiscordClient::processMessage(*payload);
+					return;
+				}
+
+				// HELLO starts a new connection
+				if (peek.op == 10 && peek.heartbeatInterval > 0)
+					_health.hello(peek.heartbeatInterval);
+
+				// Keep track of the session, so it can be resumed by the next client
+				if (peek.op == 0 && peek.s >= 0)
+					_sequence = peek.s;
+				if (peek.op == 0 && peek.t == "READY")
+				{
+					std::lock_guard<std::mutex> lock(_sessionMutex);
+					_sessionId = std::string(peek.sessionId);
+					_resumeUrl = std::string(peek.resumeUrl);
+				}
+				else if (peek.op == 9)
+				{
+					// INVALID_SESSION, the base client is about to identify from scratch
+					std::lock_guard<std::mutex> lock(_sessionMutex);
+					_sessionId.clear();
+					_resumeUrl.clear();
+				}
+
+				if (_wantsChannel && peek.op == 0 && peek.t == "MESSAGE_CREATE")
+				{
+					++_messagesReceived;
+					if (isSnowflake(peek.channelId) && isSnowflake(peek.authorId) && !_wantsChannel(peek.channelId))
+					{
+						++_messagesSkipped;
+						SleepyDiscord::DiscordClient::processMessage("{\"op\":0,\"s\":" + std::to_string(peek.s) + ",\"t\":\"MESSAGE_CREATE\",\"d\":{\"id\":\"0\",\"channel_id\":\""
+							+ std::string(peek.channelId) + "\",\"author\":{\"id\":\"" + std::string(peek.authorId) + "\"},\"content\":\"\"}}");
+						return;
+					}
+				}
+
+				SleepyDiscord::DiscordClient::processMessage(*payload);
+			}
+
+			/// Gateway traffic counters, for debugging
+			uint64_t bytesReceived() const { return _bytesReceived; }
+			uint64_t bytesInflated() const { return _bytesInflated; }
+			uint64_t messagesReceived() const { return _messagesReceived; }
+			uint64_t messagesSkipped() const { return _messagesSkipped; }
+
 		private:
 			std::function<void(SleepyDiscord::Message &)> _callback;
+			std::function<bool(std::string_view channelId)> _wantsChannel;
+			GatewayHealth& _health;
+			ZlibStreamInflater _inflater;
+
+			/// Session id and resume url from READY, and the last sequence number seen
+			mutable std::mutex _sessionMutex;
+			std::string _sessionId;
+			std::string _resumeUrl;
+			std::atomic<int64_t> _sequence{ -1 };
+
+			/// Reused buffer for inflated payloads
+			std::string _inflated;
+
+			std::atomic<uint64_t> _bytesReceived{ 0 };
+			std::atomic<uint64_t> _bytesInflated{ 0 };
+			std::atomic<uint64_t> _messagesReceived{ 0 };
+			std::atomic<uint64_t> _messagesSkipped{ 0 };
 		};
 
+		/// Sends through a bot's REST API. The only transport with embeds, files, edits and reactions.
+		class DiscordTransport : public Transport
+		{
+		public:
+			explicit DiscordTransport(CallbackDiscordClient& client) : _client(client) { }
+
+			TransportResult post(const std::string& channelId, const std::string& text) override
+			{
+				std::string messageId;
+				auto result = call([&]() -> SleepyDiscord::Response {
+					auto response = _client.sendMessage(channelId, text);
+					SleepyDiscord::Message sent = response.cast();
+					messageId = sent.ID.string();
+					return response;
+				});
+				result.messageId = std::move(messageId);
+				return result;
+			}
+
+			bool supportsRichMessages() const override
+			{
+				return true;
+			}
+
+			TransportResult postEmbeds(const std::string& channelId, const std::string& body) override
+			{
+				return call([&]() { return _client.request(SleepyDiscord::Post, SleepyDiscord::Route("channels/{channel.id}/messages", { channelId }), body); });
+			}
+
+			TransportResult postFile(const std::string& channelId, const std::filesystem::path& file, const std::string& message) override
+			{
+				return call([&]() -> SleepyDiscord::Response { return _client.uploadFile(channelId, file.string(), message); });
+			}
+
+			TransportResult edit(const std::string& channelId, const std::string& messageId, const std::string& content) override
+			{
+				return call([&]() -> SleepyDiscord::Response { return _client.editMessage(channelId, messageId, content); });
+			}
+
+			TransportResult react(const std::string& channelId, const std::string& messageId, const std::string& emoji) override
+			{
+				return call([&]() -> SleepyDiscord::Response { return _client.addReaction(channelId, messageId, emoji); });
+			}
+
+		private:
+			CallbackDiscordClient& _client;
+
+			/// Make a request, turning the response or error into a result along with the rate limit headers
+			template <typename Request>
+			static TransportResult call(Request&& request)
+			{
+				TransportResult result;
+				try
+				{
+					const SleepyDiscord::Response response = request();
+					result.response = response.text;
+					result.ok = response.statusCode >= 200 && response.statusCode < 300;
+					if (!result.ok)
+						result.error = "HTTP " + std::to_string(response.statusCode);
+
+					const auto remaining = headerValue(response, "X-RateLimit-Remaining");
+					const auto resetAfter = headerValue(response, "X-RateLimit-Reset-After");
+					const auto limit = headerValue(response, "X-RateLimit-Limit");
+					if (!remaining.empty() && !resetAfter.empty())
+					{
+						try
+						{
+							result.remaining = std::stoi(remaining);
+							result.resetAfter = std::chrono::milliseconds(static_cast<int64_t>(std::stod(resetAfter) * 1000));
+							if (!limit.empty())
+								result.limit = std::stoi(limit);
+						}
+						catch (...)
+						{
+							result.remaining = -1;
+						}
+					}
+				}
+				catch (SleepyDiscord::ErrorCode& e)
+				{
+					result.rateLimited = e == SleepyDiscord::TOO_MANY_REQUESTS || e == SleepyDiscord::RATE_LIMITED;
+					result.error = "\ar" + errorString(e) + "\aw - " + errorDesc(e);
+				}
+				return result;
+			}
+
+			/// Case insensitive lookup of a response header
+			static std::string headerValue(const SleepyDiscord::Response& response, const std::string& name)
+			{
+				for (const auto& kvp : response.header)
+					if (kvp.first.size() == name.size() && std::equal(kvp.first.begin(), kvp.first.end(), name.begin(), [](char a, char b) { return tolower(a) == tolower(b); }))
+						return kvp.second;
+				return "";
+			}
+		};
+
+		/// Rate limit budget for one route, as last reported by discord
+		struct RateLimitBucket
+		{
+			int remaining = 1;
+			std::chrono::steady_clock::time_point resetAt;
+
+			/// Sends allowed per window, 0 if discord hasn't said, and the longest reset time seen, taken as the window's length
+			int limit = 0;
+			std::chrono::milliseconds window{ 0 };
+		};
+
+		/// Somewhere to send messages, and the rate limit budget for each channel there
+		struct Endpoint
+		{
+			std::unique_ptr<Transport> transport;
+
+			/// Channel id -> budget for sending messages there
+			std::map<std::string, RateLimitBucket> buckets;
+
+			/// Budget shared by every request through the endpoint. Unlimited for local sinks.
+			TokenBucket global;
+
+			/// Remaining budget for a channel. Anything not heard about yet, or past its reset time, is assumed to have budget.
+			int remaining(const std::string& channelId, std::chrono::steady_clock::time_point now) const
+			{
+				auto bucket = buckets.find(channelId);
+				if (bucket == buckets.end() || bucket->second.resetAt <= now)
+					return std::numeric_limits<int>::max();
+				return bucket->second.remaining;
+			}
+
+			/// What's left in a channel's bucket according to discord's last answer, or 0 if there's been no answer for the current window
+			int knownRemaining(const std::string& channelId, std::chrono::steady_clock::time_point now) const
+			{
+				auto bucket = buckets.find(channelId);
+				if (bucket == buckets.end() || bucket->second.resetAt <= now)
+					return 0;
+				return bucket->second.remaining;
+			}
+		};
+
+		/// Gateway connection for one token, which is also the endpoint for sending with that token
+		struct BotConnection : Endpoint
+		{
+			size_t index = 0;
+			std::unique_ptr<CallbackDiscordClient> client;
+			std::future<void> running;
+
+			/// Consecutive reconnects without a heartbeat being acknowledged, and when the next one is allowed
+			uint32_t reconnectAttempts = 0;
+			std::chrono::steady_clock::time_point nextReconnect;
+
+			/// Key of the gateway session this connection has checked out of the store, empty if none
+			std::string sessionKey;
+		};
+
+		/// Character the gateway sessions are saved under, empty to always identify from scratch, and the directory they're saved in
+		const std::string _sessionName;
+		const std::string _sessionDirectory;
+
+		/// Recent chat for !tail and !grep. Shared with the plugin, which adds to it, and kept across reloads. Null if turned off.
+		const std::shared_ptr<ChatHistory> _history;
+
+		/// Most lines !tail and !grep send back
+		static constexpr size_t MaxHistoryResults = 100;
+
+		/// Local sinks, keyed by transport and target, and which channels go to them. Only accessed from the background thread.
+		std::map<std::string, std::unique_ptr<Endpoint>> _sinks;
+		std::map<std::string, Endpoint *> _sinkChannels;
+
+		/// One per token. Only accessed from the background thread.
+		std::vector<std::unique_ptr<BotConnection>> _connections;
+
+		/// Heartbeat timings, one per token. Created up front so they can be read from any thread.
+		std::vector<GatewayHealth> _health;
+
+		/// Jitter for reconnect backoff
+		std::mt19937 _random{ std::random_device{}() };
+
+		/// FNV-1a, used where the result has to be the same in every process
+		static uint32_t hashString(std::string_view s)
+		{
+			uint32_t hash = 2166136261u;
+			for (auto c : s)
+			{
+				hash ^= static_cast<uint8_t>(c);
+				hash *= 16777619u;
+			}
+			return hash;
+		}
+
+		/// The token that handles incoming messages on a channel. Every box works this out the same way, so a command is only ever run once.
+		size_t ownerIndex(std::string_view channelId) const
+		{
+			return hashString(channelId) % _tokens.size();
+		}
+
+		/// Pick the connection to send a message to a channel with
+		BotConnection& connectionFor(const std::string& channelId)
+		{
+			auto& owner = *_connections[ownerIndex(channelId)];
+			if (_tokenAssignment == TokenAssignment::Hash)
+				return owner;
+
+			// Prefer the owner when it's a tie, so a quiet channel sticks to one token
+			const auto now = std::chrono::steady_clock::now();
+			auto best = &owner;
+			for (auto& connection : _connections)
+				if (connection->remaining(channelId, now) > best->remaining(channelId, now))
+					best = connection.get();
+			return *best;
+		}
+
+		/// Where to send a channel's messages: its local sink, or the token that should post there
+		Endpoint& endpointFor(const std::string& channelId)
+		{
+			auto sink = _sinkChannels.find(channelId);
+			if (sink != _sinkChannels.end())
+				return *sink->second;
+			return connectionFor(channelId);
+		}
+
+		/// Record the rate limit budget a transport reported for a channel
+		static void updateBucket(Endpoint& endpoint, const std::string& channelId, const TransportResult& result)
+		{
+			if (result.remaining < 0)
+				return;
+
+			auto& bucket = endpoint.buckets[channelId];
+			bucket.remaining = result.remaining;
+			bucket.resetAt = std::chrono::steady_clock::now() + result.resetAfter;
+			if (result.limit > 0)
+				bucket.limit = result.limit;
+			bucket.window = std::max(bucket.window, result.resetAfter);
+		}
+
+		/// Mark a channel as out of budget for an endpoint after being told we're rate limited. remainingBefore is the channel's knownRemaining
+		/// from before the request. If discord had said it had plenty left, it was most likely the token's global limit that was hit, so that's
+		/// paused too. A bucket nothing is known about, e.g. the first send to a channel other boxes are also posting to, only pauses itself.
+		static void exhaustBucket(Endpoint& endpoint, const std::string& channelId, int remainingBefore = 0)
+		{
+			const auto now = std::chrono::steady_clock::now();
+			auto& bucket = endpoint.buckets[channelId];
+			bucket.remaining = 0;
+			bucket.resetAt = now + std::chrono::milliseconds(1000);
+			if (remainingBefore > 1)
+				endpoint.global.exhaust(now, std::chrono::milliseconds(1000));
+		}
+
 		void onMessageReceived(SleepyDiscord::Message& message)
 		{
 			//_writeDebug("Message received: %s", message.content.c_str());
@@ -254,16 +1494,31 @@ namespace MQ2Discord
 			// Basic commands
 			if (message.content == "!status")
 			{
-				enqueue(channel->id, _parseMacroData(channel->prefix) + "Status: Connected");
+				reply(*channel, "Status: Connected");
 				return;
 			}
 			if (message.startsWith("!echo "))
 			{
 				if (std::find(_userIds.begin(), _userIds.end(), static_cast<std::string>(message.author.ID)) != _userIds.end())
-					enqueue(channel->id, _parseMacroData(channel->prefix + message.content.substr(6, message.content.size() - 6)));
+					evaluate(channel->prefix + message.content.substr(6, message.content.size() - 6), [this, channelId = channel->id](std::string result) {
+						enqueue(channelId, result);
+					});
+				else
+				{
+					reply(*channel, "You are not authorized to issue commands on this channel");
+					_writeWarning("Command received on channel %s from unauthorized user %s", channel->id.c_str(), ((std::string)message.author.ID).c_str());
+				}
+				return;
+			}
+
+			// Look back through chat that wasn't relayed. It can have private tells in it, so only allowed users get to see it.
+			if (message.content == "!tail" || message.startsWith("!tail ") || message.startsWith("!grep "))
+			{
+				if (std::find(_userIds.begin(), _userIds.end(), static_cast<std::string>(message.author.ID)) != _userIds.end())
+					searchHistory(*channel, unescape_json(message.content));
 				else
 				{
-					enqueue(channel->id, _parseMacroData(channel->prefix) + "You are not authorized to issue commands on this channel");
+					reply(*channel, "You are not authorized to issue commands on this channel");
 					_writeWarning("Command received on channel %s from unauthorized user %s", channel->id.c_str(), ((std::string)message.author.ID).c_str());
 				}
 				return;
@@ -274,25 +1529,177 @@ namespace MQ2Discord
 			{
 				if (!channel->allow_commands)
 				{
-					enqueue(channel->id, _parseMacroData(channel->prefix) + "Commands are not allowed on this channel");
+					reply(*channel, "Commands are not allowed on this channel");
 					_writeWarning("Command received on channel with commands disabled: %s", channel->id.c_str());
 					return;
 				}
 				if (std::find(_userIds.begin(), _userIds.end(), static_cast<std::string>(message.author.ID)) != _userIds.end())
 				{
-					_executeCommand(unescape_json(message.content));
+					// A message with several lines is a batch, run in order and acknowledged with one reaction when it's done
+					auto commands = splitCommands(unescape_json(message.content));
+					std::function<void()> done;
+					if (commands.size() > 1)
+					{
+						done = [acks = std::weak_ptr<CommandAcks>(_commandAcks), channelId = channel->id, messageId = static_cast<std::string>(message.ID)]() {
+							if (auto shared = acks.lock())
+							{
+								std::lock_guard<std::mutex> lock(shared->mutex);
+								shared->pending.emplace_back(channelId, messageId);
+							}
+						};
+					}
+					_executeCommands(std::move(commands), std::move(done));
+
 					if (channel->show_command_response > 0)
+					{
 						_responseExpiryTimes[&*channel] = std::chrono::system_clock::now() + std::chrono::milliseconds(channel->show_command_response);
+						const int64_t windowEnd = (std::chrono::steady_clock::now() + std::chrono::milliseconds(channel->show_command_response)).time_since_epoch().count();
+						if (windowEnd > _responseWindowEnd)
+							_responseWindowEnd = windowEnd;
+					}
 				}
 				else
 				{
-					enqueue(channel->id, _parseMacroData(channel->prefix) + "You are not authorized to issue commands on this channel");
+					reply(*channel, "You are not authorized to issue commands on this channel");
 					_writeWarning("Command received on channel %s from unauthorized user %s", channel->id.c_str(), ((std::string)message.author.ID).c_str());
 				}
 			}
 
 		}
 
+		/// Answer "!tail [lines]" or "!grep <text> [minutes]" from the chat history. The search runs here on the background thread, and the
+		/// results are queued like any other lines, so they're batched and split into messages the same way.
+		void searchHistory(const ChannelConfig& channel, std::string command)
+		{
+			if (!_history)
+			{
+				reply(channel, "Chat history is turned off, set history_kb to turn it on");
+				return;
+			}
+
+			while (!command.empty() && isspace(static_cast<unsigned char>(command.back())))
+				command.pop_back();
+
+			// An optional number at the end: lines for !tail, minutes for !grep. "!grep 123" searches for 123.
+			const bool tail = command.compare(0, 5, "!tail") == 0;
+			const auto lastSpace = command.find_last_of(' ');
+			size_t number = 0;
+			if (lastSpace != std::string::npos && (tail || lastSpace > 5) && lastSpace + 1 < command.size()
+				&& std::all_of(command.begin() + lastSpace + 1, command.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)) != 0; }))
+			{
+				number = static_cast<size_t>(std::min(std::stoull(command.substr(lastSpace + 1, 9)), 1000000000ull));
+				command.erase(lastSpace);
+			}
+
+			std::vector<ChatHistory::Line> lines;
+			std::string header;
+			if (tail)
+			{
+				lines = _history->tail(std::min(number > 0 ? number : 20, MaxHistoryResults));
+				header = "Last " + std::to_string(lines.size()) + " lines:";
+			}
+			else
+			{
+				auto pattern = command.substr(std::min<size_t>(command.size(), 6));
+				while (!pattern.empty() && isspace(static_cast<unsigned char>(pattern.front())))
+					pattern.erase(pattern.begin());
+				if (pattern.empty())
+				{
+					reply(channel, "Usage: !grep <text> [minutes], or !grep re:<regular expression> [minutes]");
+					return;
+				}
+
+				const auto window = number > 0 ? std::chrono::system_clock::duration(std::chrono::minutes(number)) : std::chrono::system_clock::duration::max() / 2;
+				ChatHistory::SearchStats stats;
+				std::string error;
+				lines = _history->grep(pattern, window, MaxHistoryResults, stats, error);
+				if (!error.empty())
+				{
+					reply(channel, "Bad regular expression: " + error);
+					return;
+				}
+
+				header = std::to_string(lines.size()) + " lines matching `" + escape_discord(pattern) + "`"
+					+ (number > 0 ? " in the last " + std::to_string(number) + " minutes" : std::string())
+					+ " (searched " + std::to_string(stats.blocksScanned) + " of " + std::to_string(stats.blocks) + " blocks):";
+			}
+
+			std::vector<std::string> results;
+			for (const auto& line : lines)
+				results.push_back("[" + ChatHistory::timeOfDay(line.time) + "] " + escape_discord(line.text));
+
+			// The prefix needs the main thread, and the lines go out with the header so they stay in order
+			evaluate(channel.prefix, [this, channelId = channel.id, header = std::move(header), results = std::move(results)](std::string prefix) {
+				enqueue(channelId, prefix + header);
+				for (const auto& result : results)
+					enqueue(channelId, result);
+			});
+		}
+
+		/// Each line of a message that starts with a / is a command. Anything else, like blank lines, is ignored.
+		static std::vector<std::string> splitCommands(const std::string& content)
+		{
+			std::vector<std::string> commands;
+			size_t start = 0;
+			while (start <= content.size())
+			{
+				auto end = content.find('\n', start);
+				if (end == std::string::npos)
+					end = content.size();
+
+				auto line = content.substr(start, end - start);
+				while (!line.empty() && isspace(static_cast<unsigned char>(line.back())))
+					line.pop_back();
+				const auto first = line.find_first_not_of(" \t");
+				if (first != std::string::npos && line[first] == '/')
+					commands.push_back(line.substr(first));
+
+				start = end + 1;
+			}
+			return commands;
+		}
+
+		/// React to every batch of commands that's finished running, as far as rate limits allow
+		void sendCommandAcks(std::chrono::steady_clock::time_point& next)
+		{
+			std::vector<std::pair<std::string, std::string>> acks;
+			{
+				std::lock_guard<std::mutex> lock(_commandAcks->mutex);
+				std::swap(acks, _commandAcks->pending);
+			}
+
+			for (size_t i = 0; i < acks.size(); ++i)
+			{
+				const auto& [channelId, messageId] = acks[i];
+				const auto bucketKey = "reactions " + channelId;
+				auto& connection = *_connections[ownerIndex(channelId)];
+				const auto now = std::chrono::steady_clock::now();
+				const auto remaining = connection.remaining(bucketKey, now);
+				const auto knownRemaining = connection.knownRemaining(bucketKey, now);
+				const auto available = connection.global.availableAt(now);
+				if (pastStopDeadline() || remaining <= 0 || available > now)
+				{
+					// Put the rest back for next time
+					next = std::min(next, remaining <= 0 ? connection.buckets[bucketKey].resetAt : available);
+					std::lock_guard<std::mutex> lock(_commandAcks->mutex);
+					_commandAcks->pending.insert(_commandAcks->pending.begin(), acks.begin() + i, acks.end());
+					return;
+				}
+
+				connection.global.take(now);
+				const auto result = connection.transport->react(channelId, messageId, BatchDoneReaction);
+				updateBucket(connection, bucketKey, result);
+				if (result.rateLimited)
+				{
+					exhaustBucket(connection, bucketKey, knownRemaining);
+					--i;
+					continue;
+				}
+				if (!result.ok)
+					_writeError("Failed to react to commands in %s: %s", channelId.c_str(), result.error.c_str());
+			}
+		}
+
 		static std::string errorString(SleepyDiscord::ErrorCode errorCode)
 		{
 			switch (errorCode)
@@ -440,98 +1847,613 @@ namespace MQ2Discord
 			return result;
 		}
 
-		void threadStart()
+		/// Removes and returns as many whole lines from the front of text as fit in maxLength. A single line longer than that is cut.
+		static std::string takeLines(std::string& text, size_t maxLength)
 		{
-			try
+			if (text.length() <= maxLength)
+				return std::move(text);
+
+			auto end = text.rfind('\n', maxLength - 1);
+			end = end == std::string::npos ? maxLength : end + 1;
+			auto result = text.substr(0, end);
+			text.erase(0, end);
+			return result;
+		}
+
+		/// Posts or edits the live message of every rolling channel that has pending lines and whose edit interval has passed.
+		/// Rate limited or failed updates are left pending and retried later. Brings next forward to when the next edit is due.
+		void flushRollingMessages(std::chrono::steady_clock::time_point& next)
+		{
+			const auto now = std::chrono::steady_clock::now();
+			for (auto& kvp : _rollingMessages)
 			{
-				CallbackDiscordClient client(_token, [this](auto&& PH1) { onMessageReceived(std::forward<decltype(PH1)>(PH1)); });
-				client.setIntents(SleepyDiscord::Intent::SERVER_MESSAGES);
+				auto& rolling = kvp.second;
+				if (rolling.pending.empty() || pastStopDeadline())
+					continue;
+				if (now < rolling.nextUpdate())
+				{
+					next = std::min(next, rolling.nextUpdate());
+					continue;
+				}
 
-				auto clientAsync = std::async(std::launch::async, [&]() {
-					client.run();
-				});
+				// Start a new message if there isn't one yet, or if the edit would take it over the length limit
+				auto * connection = _connections[rolling.connection].get();
+				const bool start = rolling.messageId.empty() || rolling.content.length() + rolling.pending.length() > MaxMessageLength;
+				if (start)
+					connection = &connectionFor(rolling.channelId);
+
+				// Edits count against the token's global limit like any other request
+				const auto available = connection->global.availableAt(now);
+				if (available > now)
+				{
+					next = std::min(next, available);
+					continue;
+				}
+				connection->global.take(now);
+				const auto knownRemaining = connection->knownRemaining(rolling.channelId, now);
+
+				std::string pending = rolling.pending;
+				TransportResult result;
+				std::string content;
+				if (start)
+				{
+					content = takeLines(pending, MaxMessageLength);
+					result = connection->transport->post(rolling.channelId, content);
+				}
+				else
+				{
+					content = rolling.content + pending;
+					pending.clear();
+					result = connection->transport->edit(rolling.channelId, rolling.messageId, content);
+				}
+				updateBucket(*connection, rolling.channelId, result);
+
+				if (result.rateLimited)
+				{
+					exhaustBucket(*connection, rolling.channelId, knownRemaining);
+					next = std::min(next, connection->buckets[rolling.channelId].resetAt);
+					continue;
+				}
+				if (!result.ok || (start && result.messageId.empty()))
+				{
+					// Most likely the live message was deleted, so start a new one next time. If it keeps failing, e.g. for a missing permission,
+					// back off and only say so once.
+					if (rolling.failures == 0)
+						_writeError("Failed to update rolling message in %s: %s", rolling.channelId.c_str(), result.error.c_str());
+					rolling.messageId.clear();
+					rolling.content.clear();
+					rolling.lastUpdate = now;
+					++rolling.failures;
+					next = std::min(next, rolling.nextUpdate());
+					continue;
+				}
+
+				if (start)
+				{
+					rolling.messageId = result.messageId;
+					rolling.connection = connection->index;
+				}
+				rolling.content = std::move(content);
+				rolling.pending = std::move(pending);
+				rolling.lastUpdate = now;
+				rolling.failures = 0;
+				if (!rolling.pending.empty())
+					next = std::min(next, now + rolling.interval);
+			}
+		}
+
+		/// Move everything in the queue to the pending lines of its channel, or to its rolling message
+		void drainQueue()
+		{
+			std::queue<QueuedMessage> messages;
+			{
+				std::lock_guard<std::mutex> lock(_messagesMutex);
+				std::swap(messages, _messages);
+			}
+
+			while (!messages.empty())
+			{
+				auto& message = messages.front();
+				LatencyTracer::stamp(message.trace, TraceStage::Batched);
+				if (message.broadcast)
+				{
+					// Fan out to each channel now, sharing the one copy of the text until here
+					for (const auto& target : message.broadcast->targets)
+						drainLine(target.channelId, target.prefix + message.broadcast->text, target.channel, target.mode, target.rollingKey, message.trace);
+				}
+				else
+				{
+					drainLine(message.channelId, std::move(message.text), message.channel, message.mode, message.rollingKey, message.trace);
+				}
+				messages.pop();
+			}
+		}
+
+		/// Add a line to the pending lines of its channel, or to its rolling message
+		void drainLine(const std::string& channelId, std::string text, const ChannelConfig * channel, SendMode mode, const std::string& rollingKey, const TraceStamps& trace)
+		{
+			// Rolling channels collect lines into their live message, which is edited in flushRollingMessages
+			if (mode == SendMode::Rolling && channel)
+			{
+				auto& rolling = _rollingMessages[channelId + "|" + rollingKey];
+				rolling.channelId = channelId;
+				rolling.interval = std::chrono::milliseconds(channel->rolling_interval);
+				rolling.pending += text + '\n';
+				return;
+			}
+
+			auto& pending = (mode == SendMode::Embed && channel ? _pendingEmbeds : _pendingLines)[channelId];
+			if (channel)
+				pending.channel = channel;
+			pending.lines.push_back(std::move(text));
+			pending.traces.push_back(trace);
+		}
+
+		/// Pack lines from the front of a channel's queue into the JSON body of a message with up to MaxEmbeds embeds, each line going into
+		/// the description of the current embed until it's full. Sets count to how many lines were used.
+		static std::string buildEmbeds(const std::deque<std::string>& lines, uint32_t color, size_t& count)
+		{
+			std::string body = "{\"embeds\":[";
+			std::string description;
+			size_t embeds = 0;
+			size_t total = 0;
+
+			const auto closeEmbed = [&]() {
+				if (description.empty())
+					return;
+				if (embeds > 0)
+					body += ',';
+				body += "{\"description\":\"" + escape_json(description) + "\"";
+				if (color != 0)
+					body += ",\"color\":" + std::to_string(color);
+				body += '}';
+				description.clear();
+				++embeds;
+			};
+
+			count = 0;
+			while (count < lines.size())
+			{
+				const auto line = lines[count].substr(0, MaxEmbedDescription - 1);
+				if (total + line.length() + 1 > MaxEmbedsLength)
+					break;
+
+				// Start another embed when this one's full, as long as there's room for one
+				if (description.length() + line.length() + 1 > MaxEmbedDescription)
+				{
+					if (embeds + 2 > MaxEmbeds)
+						break;
+					closeEmbed();
+				}
+
+				description += line + '\n';
+				total += line.length() + 1;
+				++count;
+			}
+			closeEmbed();
+
+			return body + "]}";
+		}
+
+		/// How many lines from the front of pending should go into an attachment instead of messages, 0 if the channel's
+		/// attachment_threshold hasn't been reached
+		static size_t attachmentLines(const PendingLines& pending)
+		{
+			if (!pending.channel || pending.channel->attachment_threshold == 0)
+				return 0;
+
+			size_t length = 0;
+			size_t count = 0;
+			while (count < pending.lines.size() && length + pending.lines[count].length() + 1 <= MaxAttachmentLength)
+				length += pending.lines[count++].length() + 1;
+
+			return length > pending.channel->attachment_threshold ? count : 0;
+		}
+
+		/// Write the first count lines straight from the queue into a temporary file, gzipped if compress is set.
+		/// Returns the path, or an empty path if the file couldn't be written.
+		std::filesystem::path writeAttachment(const std::string& channelId, const std::deque<std::string>& lines, size_t count, bool compress)
+		{
+			std::error_code ec;
+			auto path = std::filesystem::temp_directory_path(ec);
+			if (ec)
+				return {};
+			path /= "MQ2Discord-" + channelId + "-" + std::to_string(++_attachmentCount) + (compress ? ".txt.gz" : ".txt");
 
-				// Give the client time to connect
-				//std::this_thread::sleep_for(std::chrono::milliseconds(2000));
-				//if (client.isReady())
+			bool written = true;
+			if (compress)
+			{
+				gzFile file = gzopen(path.string().c_str(), "wb");
+				if (!file)
+					return {};
+				for (size_t i = 0; i < count && written; ++i)
 				{
-					_writeNormal("Ready");
+					written = gzwrite(file, lines[i].data(), static_cast<unsigned>(lines[i].length())) == static_cast<int>(lines[i].length())
+						&& gzputc(file, '\n') == '\n';
+				}
+				written = gzclose(file) == Z_OK && written;
+			}
+			else
+			{
+				std::ofstream file(path, std::ios::binary);
+				for (size_t i = 0; i < count && file; ++i)
+					file << lines[i] << '\n';
+				written = static_cast<bool>(file);
+			}
+
+			if (!written)
+			{
+				std::filesystem::remove(path, ec);
+				return {};
+			}
+			return path;
+		}
+
+		/// Send one batch from the front of a channel's pending lines. The caller has checked there's budget for it.
+		/// Rate limited lines are kept to try again when there's budget, possibly with another token.
+		void sendBatch(const std::string& channelId, PendingLines& pending, bool embeds)
+		{
+			auto& lines = pending.lines;
+			auto& endpoint = endpointFor(channelId);
+			auto& transport = *endpoint.transport;
+			const auto now = std::chrono::steady_clock::now();
+			const auto knownRemaining = endpoint.knownRemaining(channelId, now);
+			endpoint.global.take(now);
+
+			size_t count = 0;
+			std::filesystem::path attachment;
+			TransportResult result;
+			const auto attachmentCount = transport.supportsRichMessages() ? attachmentLines(pending) : 0;
+			if (attachmentCount > 0)
+				attachment = writeAttachment(channelId, lines, attachmentCount, pending.channel->attachment_compress);
+
+			const auto sent = LatencyTracer::now();
+			if (!attachment.empty())
+			{
+				// A big burst goes up as one file with a summary, rather than a wall of messages
+				std::error_code ec;
+				const auto size = std::filesystem::file_size(attachment, ec);
+				result = transport.postFile(channelId, attachment,
+					std::to_string(attachmentCount) + " lines (" + std::to_string((ec ? 0 : size) / 1024 + 1) + " KB) attached");
+				count = attachmentCount;
+			}
+			else if (embeds && transport.supportsRichMessages())
+			{
+				result = transport.postEmbeds(channelId, buildEmbeds(lines, pending.channel ? pending.channel->embed_color : 0, count));
+			}
+			else
+			{
+				// Combine lines until the message is too long, and leave the rest for the next batch
+				std::string batch;
+				while (count < lines.size() && batch.length() <= transport.maxBatchLength())
+					batch += lines[count++] + '\n';
+				result = transport.post(channelId, batch);
+			}
+			removeAttachment(attachment);
+			updateBucket(endpoint, channelId, result);
+
+			// If we're rate limited, keep the lines to try again when there's budget. Anything else, bail out
+			if (result.rateLimited)
+			{
+				exhaustBucket(endpoint, channelId, knownRemaining);
+				return;
+			}
+			if (!result.response.empty())
+				_writeDebug(result.response.c_str());
+			if (!result.ok)
+				_writeError("Failed to send message to %s: %s", channelId.c_str(), result.error.c_str());
+
+			const auto acknowledged = LatencyTracer::now();
+			for (size_t i = 0; i < count; ++i)
+			{
+				auto& trace = pending.traces[i];
+				trace[static_cast<size_t>(TraceStage::Sent)] = sent;
+				trace[static_cast<size_t>(TraceStage::Acknowledged)] = acknowledged;
+				_tracer.record(trace, channelId);
+			}
+
+			lines.erase(lines.begin(), lines.begin() + count);
+			pending.traces.erase(pending.traces.begin(), pending.traces.begin() + count);
+		}
+
+		static void removeAttachment(const std::filesystem::path& path)
+		{
+			std::error_code ec;
+			if (!path.empty())
+				std::filesystem::remove(path, ec);
+		}
+
+		/// Send as much of what's queued as rate limits allow. Returns when it's next worth trying.
+		std::chrono::steady_clock::time_point flush()
+		{
+			drainQueue();
+
+			auto next = std::chrono::steady_clock::now() + FlushInterval;
 
-					int count = 0;
-					while (!_stop)
+			// Channels take turns a batch at a time. Out of those whose own bucket and token's global budget both allow a send,
+			// fair queuing picks which goes next, so a busy channel can't starve the rest of the global budget.
+			while (!pastStopDeadline())
+			{
+				const auto now = std::chrono::steady_clock::now();
+				const std::string * bestId = nullptr;
+				PendingLines * best = nullptr;
+				bool bestEmbeds = false;
+				double bestStart = 0;
+				for (auto [queue, embeds] : { std::make_pair(&_pendingLines, false), std::make_pair(&_pendingEmbeds, true) })
+				{
+					for (auto& [channelId, pending] : *queue)
 					{
-						_stopped = false;
-						// Every minute, send typing, to keep connection alive. Crude timer based on 1s sleep below
-						try
+						if (pending.lines.empty())
+							continue;
+
+						auto& endpoint = endpointFor(channelId);
+						if (endpoint.remaining(channelId, now) <= 0)
 						{
-							if (++count % 60 == 0 && !client.isRateLimited())
-							{
-								client.updateStatus();
-								for (const auto& channel : _channels)
-									client.sendTyping(channel.id);
-							}
+							next = std::min(next, endpoint.buckets[channelId].resetAt);
+							continue;
+						}
+						const auto available = endpoint.global.availableAt(now);
+						if (available > now)
+						{
+							next = std::min(next, available);
+							continue;
 						}
-						// This is not so critical that it should shut things down if it doesn't work
-						catch (...)	{ }
 
-						// grab all queued messages, put them into a map of channel -> combined message
-						std::map<std::string, std::string> combinedMessages;
-						while (true)
+						const auto start = _fairQueue.nextStart(channelId);
+						if (!best || start < bestStart)
 						{
-							std::tuple<std::string, std::string> message;
-							{
-								std::lock_guard<std::mutex> lock(_messagesMutex);
-								if (_messages.empty())
-									break;
-								message = _messages.front();
-								_messages.pop();
-							}
-							//combinedMessages[std::get<0>(message)] += escape_json(std::get<1>(message) + "\n");
-							combinedMessages[std::get<0>(message)] += std::get<1>(message) + '\n';
+							bestId = &channelId;
+							best = &pending;
+							bestEmbeds = embeds;
+							bestStart = start;
+						}
+					}
+				}
+				if (!best)
+					break;
+
+				_fairQueue.charge(*bestId, weightFor(*bestId, *best));
+				sendBatch(*bestId, *best, bestEmbeds);
+			}
+
+			for (auto* queue : { &_pendingLines, &_pendingEmbeds })
+				for (auto it = queue->begin(); it != queue->end();)
+					it = it->second.lines.empty() ? queue->erase(it) : std::next(it);
+
+			flushRollingMessages(next);
+			sendCommandAcks(next);
+			predictBacklog();
+
+			return next;
+		}
+
+		/// A channel's share of the global budget when it's competing with others
+		uint32_t weightFor(const std::string& channelId, const PendingLines& pending) const
+		{
+			if (pending.channel)
+				return pending.channel->weight;
+			auto channel = std::find_if(_channels.begin(), _channels.end(), [&](const ChannelConfig& c) { return c.id == channelId; });
+			return channel == _channels.end() ? 1 : channel->weight;
+		}
 
-							// If the message is too long, send what we currently have and grab the rest the next go through
-							if (combinedMessages[std::get<0>(message)].length() > 1800)
-								break;
+		/// Work out how many batches are queued and when they'll all have been sent, for /discord stats
+		void predictBacklog()
+		{
+			const auto now = std::chrono::steady_clock::now();
+			std::vector<Backlog> backlogs;
+			std::vector<TokenBucket> budgets;
+			std::map<const Endpoint *, size_t> budgetIndex;
+			size_t total = 0;
+
+			for (auto [queue, embeds] : { std::make_pair(&_pendingLines, false), std::make_pair(&_pendingEmbeds, true) })
+			{
+				for (const auto& [channelId, pending] : *queue)
+				{
+					auto& endpoint = endpointFor(channelId);
+
+					// Same packing as sending, roughly: embeds by total length, text by greedily filling each batch
+					Backlog backlog;
+					backlog.channelId = channelId;
+					backlog.weight = weightFor(channelId, pending);
+					const auto maxLength = embeds && endpoint.transport->supportsRichMessages() ? MaxEmbedsLength : endpoint.transport->maxBatchLength();
+					size_t length = 0;
+					for (const auto& line : pending.lines)
+					{
+						if (length == 0 || length + line.length() + 1 > maxLength)
+						{
+							++backlog.batches;
+							length = 0;
 						}
+						length += line.length() + 1;
+					}
+					if (backlog.batches == 0)
+						continue;
+					total += backlog.batches;
+
+					auto index = budgetIndex.find(&endpoint);
+					if (index == budgetIndex.end())
+					{
+						index = budgetIndex.emplace(&endpoint, budgets.size()).first;
+						budgets.push_back(endpoint.global);
+					}
+					backlog.budget = index->second;
+
+					auto bucket = endpoint.buckets.find(channelId);
+					if (bucket != endpoint.buckets.end())
+					{
+						backlog.remaining = bucket->second.resetAt > now ? bucket->second.remaining : 0;
+						backlog.resetAt = bucket->second.resetAt;
+						backlog.limit = std::max(bucket->second.limit, 1);
+						backlog.window = std::max(bucket->second.window, std::chrono::milliseconds(1000));
+					}
+					backlogs.push_back(std::move(backlog));
+				}
+			}
+
+			_backlogBatches = total;
+			_backlogDrainMs = std::chrono::duration_cast<std::chrono::milliseconds>(predictDrain(std::move(backlogs), std::move(budgets), _fairQueue, now) - now).count();
+		}
+
+		void scheduleFlush(std::chrono::steady_clock::time_point when)
+		{
+			_flushTimer.expires_at(when);
+			_flushTimer.async_wait([this](const asio::error_code& ec) {
+				if (ec || _stop)
+					return;
+				scheduleFlush(flush());
+			});
+		}
+
+		/// Restart any connection that's stopped getting heartbeat acks, backing off exponentially with jitter while it keeps failing
+		void checkHealth()
+		{
+			const auto now = std::chrono::steady_clock::now();
+			const auto time = GatewayHealth::now();
+			for (auto& connection : _connections)
+			{
+				auto& health = _health[connection->index];
+				if (!health.isZombie(time))
+				{
+					if (health.heartbeatAcked > health.heartbeatSent)
+						connection->reconnectAttempts = 0;
+					continue;
+				}
+
+				if (now < connection->nextReconnect)
+					continue;
+
+				const auto backoff = std::min(MaxReconnectBackoff, std::chrono::milliseconds(ReconnectBackoff.count() << std::min(connection->reconnectAttempts, 16u)));
+				const auto jittered = std::chrono::milliseconds(std::uniform_int_distribution<int64_t>(backoff.count() / 2, backoff.count())(_random));
+				connection->nextReconnect = now + jittered;
+				++connection->reconnectAttempts;
+				++health.reconnects;
+
+				_writeWarning("Gateway %zu missed a heartbeat ack, reconnecting", connection->index);
+				try
+				{
+					connection->client->resumeConnection();
+				}
+				catch (...) { }
+			}
+		}
+
+		void scheduleHealthCheck()
+		{
+			_healthTimer.expires_after(HealthCheckInterval);
+			_healthTimer.async_wait([this](const asio::error_code& ec) {
+				if (ec || _stop)
+					return;
+				checkHealth();
+				scheduleHealthCheck();
+			});
+		}
+
+		void scheduleSinkSync()
+		{
+			_syncTimer.expires_after(SinkSyncInterval);
+			_syncTimer.async_wait([this](const asio::error_code& ec) {
+				if (ec || _stop)
+					return;
+				for (auto& sink : _sinks)
+					sink.second->transport->sync();
+				scheduleSinkSync();
+			});
+		}
+
+		void threadStart()
+		{
+			try
+			{
+				// Every token gets its own connection, but each only handles messages on the channels it owns
+				for (size_t i = 0; i < _tokens.size(); ++i)
+				{
+					auto connection = std::make_unique<BotConnection>();
+					connection->index = i;
+					connection->client = std::make_unique<CallbackDiscordClient>(_tokens[i],
+						[this, i](SleepyDiscord::Message& message) {
+							if (ownerIndex(static_cast<std::string>(message.channelID)) == i)
+								onMessageReceived(message);
+						},
+						[this, i](std::string_view channelId) {
+							return ownerIndex(channelId) == i
+								&& std::any_of(_channels.begin(), _channels.end(), [&](const auto& channel) { return channel.id == channelId && channel.transport == "discord"; });
+						},
+						_health[i]);
+					connection->client->setIntents(SleepyDiscord::Intent::SERVER_MESSAGES);
+					connection->transport = std::make_unique<DiscordTransport>(*connection->client);
+					connection->global = TokenBucket(_globalRateLimit, _globalRateLimit);
 
-						for (const auto& kvp : combinedMessages)
+					// Resume the last client's session rather than identifying again. The last client may still be shutting down, so give it
+					// as long as a shutdown takes to hand the session over.
+					if (!_sessionName.empty())
+					{
+						const auto key = GatewaySessionStore::key(_sessionName, _tokens[i]);
+						if (const auto session = GatewaySessionStore::checkOut(_sessionDirectory, key, ShutdownTimeout))
 						{
-							while (true)
+							connection->sessionKey = key;
+							if (session->valid())
 							{
-								try
-								{
-									const std::string messageResponse = client.sendMessage(kvp.first, kvp.second).text;
-									_writeDebug(messageResponse.c_str());
-									if (messageResponse.empty())
-									{
-										_writeError("Failed to send discord message to: %s", kvp.first.c_str());
-									}
-									break;
-								}
-								catch (SleepyDiscord::ErrorCode& e)
-								{
-									// If we're rate limited, back off a bit and try again shortly. Otherwise, bail out
-									if (e == SleepyDiscord::TOO_MANY_REQUESTS || e == SleepyDiscord::RATE_LIMITED)
-										std::this_thread::sleep_for(std::chrono::milliseconds(200));
-									else
-									{
-										_writeError("\ar%s\aw - %s", errorString(e).c_str(), errorDesc(e).c_str());
-										break;
-									}
-								}
+								_writeDebug("Gateway %zu resuming session", i);
+								connection->client->restoreSession(*session);
 							}
 						}
+					}
+
+					connection->running = std::async(std::launch::async, [client = connection->client.get()]() {
+						client->run();
+					});
+					_connections.push_back(std::move(connection));
+				}
 
-						std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+				// Channels on a local transport go to a sink instead, one per target however many channels share it
+				for (const auto& channel : _channels)
+				{
+					if (channel.transport == "discord" || _sinkChannels.count(channel.id))
+						continue;
+
+					auto& sink = _sinks[channel.transport + "|" + channel.transport_target];
+					if (!sink)
+					{
+						sink = std::make_unique<Endpoint>();
+						if (channel.transport == "file")
+							sink->transport = std::make_unique<FileSinkTransport>(channel.transport_target, uint64_t(channel.transport_max_size) * 1024 * 1024, channel.transport_keep);
+						else
+							sink->transport = std::make_unique<UdpSinkTransport>(_io, channel.transport_target);
 					}
-					_writeNormal("Disconnecting...");
+					_sinkChannels[channel.id] = sink.get();
 				}
-				/*else
+
+				_writeNormal("Ready");
+
+				// Everything from here on happens on the event loop, until Stop cancels the timers
+				scheduleFlush(std::chrono::steady_clock::now());
+				scheduleHealthCheck();
+				if (!_sinks.empty())
+					scheduleSinkSync();
+				_io.run();
+
+				// One last go at anything still queued, e.g. a disconnect notice
+				flush();
+
+				_writeNormal("Disconnecting...");
+				for (const auto& connection : _connections)
+					_writeDebug("Gateway %zu received %llu bytes (%llu inflated), skipped %llu of %llu messages", connection->index, connection->client->bytesReceived(),
+						connection->client->bytesInflated(), connection->client->messagesSkipped(), connection->client->messagesReceived());
+
+				for (auto& connection : _connections)
 				{
-					_writeError("Could not connect to Discord.");
-				}*/
-				client.quit();
-				_stopped = true;
+					if (connection->sessionKey.empty())
+					{
+						connection->client->quit();
+						continue;
+					}
+					connection->client->quitKeepingSession();
+					GatewaySessionStore::checkIn(_sessionDirectory, connection->sessionKey, connection->client->session());
+					connection->sessionKey.clear();
+				}
+				_connections.clear();
+				_sinkChannels.clear();
+				_sinks.clear();
 			}
 			catch (std::exception& e)
 			{
@@ -542,6 +2464,12 @@ namespace MQ2Discord
 				auto e = std::current_exception();
 				_writeError("Unknown error in thread");
 			}
+
+			// Don't leave sessions checked out if something went wrong, or the next client would wait for them
+			for (auto& connection : _connections)
+				if (!connection->sessionKey.empty())
+					GatewaySessionStore::checkIn(_sessionDirectory, connection->sessionKey, GatewaySession());
+			_stopped = true;
 		}
 	};
 }
\ No newline at end of file
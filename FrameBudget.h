@@ -0,0 +1,144 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#include "Histogram.h"
+
+namespace MQ2Discord
+{
+	/// Measures how long the plugin's hooks take each game frame, and whether this frame's budget has been spent.
+	/// A frame runs from one OnPulse to the next. Only used from the main thread.
+	class FrameBudget
+	{
+	public:
+		enum class Hook
+		{
+			WriteChatColor,
+			IncomingChat,
+			Pulse,
+			Count
+		};
+
+		/// Times everything until it goes out of scope against a hook and the current frame. A hook that fires inside another one,
+		/// e.g. a WriteChatf during OnPulse, is already being timed by the outer timer, so the inner one doesn't record anything.
+		class Timer
+		{
+		public:
+			Timer(FrameBudget& budget, Hook hook) : _budget(budget), _hook(hook), _start(std::chrono::steady_clock::now()), _nested(budget._timing)
+			{
+				_budget._timing = true;
+			}
+
+			~Timer()
+			{
+				if (_nested)
+					return;
+				_budget._timing = false;
+				_budget.record(_hook, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count());
+			}
+
+			Timer(const Timer&) = delete;
+			Timer& operator=(const Timer&) = delete;
+
+			/// Microseconds so far, for checking the budget before the timer has finished. 0 for a nested timer, whose time isn't counted.
+			uint64_t elapsed() const
+			{
+				return _nested ? 0 : std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+			}
+
+		private:
+			FrameBudget& _budget;
+			const Hook _hook;
+			const std::chrono::steady_clock::time_point _start;
+			const bool _nested;
+		};
+
+		/// Microseconds the plugin may spend per frame before low priority work is put off. 0 for no limit.
+		void setBudget(uint32_t budget)
+		{
+			_budget = budget;
+		}
+
+		uint32_t budget() const
+		{
+			return _budget;
+		}
+
+		/// Close off the last frame and start a new one. Call at the top of OnPulse.
+		void beginFrame()
+		{
+			if (_inFrame)
+			{
+				_frames.add(_frameSpent);
+				if (_budget > 0 && _frameSpent > _budget)
+					++_framesOverBudget;
+			}
+			_inFrame = true;
+			_frameSpent = 0;
+		}
+
+		/// Whether this frame's budget has been spent, counting extra microseconds from a timer that's still running
+		bool overBudget(uint64_t extra = 0) const
+		{
+			return _budget > 0 && _frameSpent + extra >= _budget;
+		}
+
+		/// Count a line whose low priority matching was put off to a later frame, or skipped entirely
+		void deferred()
+		{
+			++_deferred;
+		}
+
+		void shed()
+		{
+			++_shed;
+		}
+
+		std::vector<std::string> stats() const
+		{
+			static constexpr const char * HookNames[] = { "OnWriteChatColor", "OnIncomingChat", "OnPulse" };
+
+			std::vector<std::string> results;
+			for (size_t i = 0; i < static_cast<size_t>(Hook::Count); ++i)
+			{
+				const auto& hook = _hooks[i];
+				results.push_back(std::string(HookNames[i]) + ": " + std::to_string(hook.count()) + " calls, avg "
+					+ std::to_string(hook.average()) + "us, p99 " + hook.percentile(0.99) + ", max " + std::to_string(hook.max()) + "us");
+			}
+
+			results.push_back("Per frame: " + std::to_string(_frames.count()) + " frames, p50 " + _frames.percentile(0.5) + ", p99 " + _frames.percentile(0.99)
+				+ ", max " + std::to_string(_frames.max()) + "us");
+			results.push_back("Budget: " + (_budget > 0 ? std::to_string(_budget) + "us" : std::string("off")) + ", " + std::to_string(_framesOverBudget)
+				+ " frames over, " + std::to_string(_deferred) + " lines deferred, " + std::to_string(_shed) + " shed");
+			return results;
+		}
+
+	private:
+		uint32_t _budget = 0;
+		std::array<LatencyHistogram, static_cast<size_t>(Hook::Count)> _hooks{};
+
+		/// Microseconds spent so far in the current frame. Anything before the first pulse isn't counted as a frame.
+		uint64_t _frameSpent = 0;
+		bool _inFrame = false;
+
+		/// Whether a timer is running, so ones that start inside it know not to count their time again
+		bool _timing = false;
+
+		LatencyHistogram _frames;
+		uint64_t _framesOverBudget = 0;
+		uint64_t _deferred = 0;
+		uint64_t _shed = 0;
+
+		void record(Hook hook, int64_t elapsed)
+		{
+			const auto us = static_cast<uint64_t>(std::max<int64_t>(elapsed, 0));
+			_hooks[static_cast<size_t>(hook)].add(us);
+			_frameSpent += us;
+		}
+	};
+}
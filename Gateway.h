@@ -0,0 +1,337 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <zlib.h>
+
+namespace MQ2Discord
+{
+	enum class InflateResult
+	{
+		/// Waiting for the rest of the message
+		Partial,
+		Complete,
+		/// The data was corrupt. The stream has been reset, but the rest of the connection was compressed with the lost context, so it needs a new one.
+		Failed
+	};
+
+	/// Inflates a discord gateway connection using zlib-stream transport compression.
+	/// The whole connection shares one zlib context, so a new inflater is needed for every new connection.
+	class ZlibStreamInflater
+	{
+	public:
+		ZlibStreamInflater()
+		{
+			_stream.zalloc = Z_NULL;
+			_stream.zfree = Z_NULL;
+			_stream.opaque = Z_NULL;
+			_initialized = inflateInit(&_stream) == Z_OK;
+		}
+
+		~ZlibStreamInflater()
+		{
+			if (_initialized)
+				inflateEnd(&_stream);
+		}
+
+		ZlibStreamInflater(const ZlibStreamInflater&) = delete;
+		ZlibStreamInflater& operator=(const ZlibStreamInflater&) = delete;
+
+		/// Start over for a new connection
+		void reset()
+		{
+			_buffer.clear();
+			if (_initialized)
+				inflateReset(&_stream);
+		}
+
+		/// Feed a websocket frame in. Sets output once a complete message has been inflated.
+		/// Messages can span several frames, they're complete once the buffer ends with the zlib sync flush suffix.
+		InflateResult feed(const std::string& frame, std::string& output)
+		{
+			_buffer.append(frame);
+			if (_buffer.size() < 4 || _buffer.compare(_buffer.size() - 4, 4, "\x00\x00\xff\xff", 4) != 0)
+				return InflateResult::Partial;
+
+			output.clear();
+			_stream.next_in = reinterpret_cast<Bytef *>(_buffer.data());
+			_stream.avail_in = static_cast<uInt>(_buffer.size());
+
+			char chunk[16384];
+			do
+			{
+				_stream.next_out = reinterpret_cast<Bytef *>(chunk);
+				_stream.avail_out = sizeof(chunk);
+				const auto result = inflate(&_stream, Z_SYNC_FLUSH);
+				if (result != Z_OK && result != Z_BUF_ERROR)
+				{
+					reset();
+					return InflateResult::Failed;
+				}
+				output.append(chunk, sizeof(chunk) - _stream.avail_out);
+			} while (_stream.avail_out == 0);
+
+			_buffer.clear();
+			return InflateResult::Complete;
+		}
+
+		bool isValid() const
+		{
+			return _initialized;
+		}
+
+	private:
+		z_stream _stream{};
+		bool _initialized;
+
+		/// Compressed data received so far for the current message
+		std::string _buffer;
+	};
+
+	/// The handful of fields needed to decide whether a gateway payload is worth deserializing properly
+	struct GatewayPeek
+	{
+		int op = -1;
+		int64_t s = -1;
+		std::string_view t;
+		std::string_view channelId;
+		std::string_view authorId;
+
+		/// From HELLO
+		int64_t heartbeatInterval = -1;
+
+		/// From READY
+		std::string_view sessionId;
+		std::string_view resumeUrl;
+	};
+
+	/// Heartbeat timings for one gateway connection, written by the connection and read by anything. Times are steady clock milliseconds.
+	struct GatewayHealth
+	{
+		std::atomic<int64_t> heartbeatInterval{ 0 };
+		std::atomic<int64_t> heartbeatSent{ 0 };
+		std::atomic<int64_t> heartbeatAcked{ 0 };
+
+		/// Round trip time of the last acknowledged heartbeat, -1 until there is one
+		std::atomic<int64_t> heartbeatRtt{ -1 };
+
+		/// How many times the connection has been restarted for missing a heartbeat ack
+		std::atomic<uint32_t> reconnects{ 0 };
+
+		static int64_t now()
+		{
+			return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		/// A new connection has started, so forget about heartbeats from the old one
+		void hello(int64_t interval)
+		{
+			heartbeatInterval = interval;
+			heartbeatSent = 0;
+			heartbeatAcked = 0;
+		}
+
+		void sent()
+		{
+			heartbeatSent = now();
+		}
+
+		void acked()
+		{
+			const auto time = now();
+			heartbeatAcked = time;
+			if (heartbeatSent > 0)
+				heartbeatRtt = time - heartbeatSent;
+		}
+
+		/// A connection is dead if a heartbeat has gone unacknowledged for a whole interval, i.e. the next one is due without hearing back
+		bool isZombie(int64_t time) const
+		{
+			const int64_t sentAt = heartbeatSent;
+			return heartbeatInterval > 0 && sentAt > heartbeatAcked && time - sentAt > heartbeatInterval;
+		}
+	};
+
+	/// Whether an id from a payload is a plain snowflake, i.e. only digits, and so safe to put back into JSON as it is
+	inline bool isSnowflake(std::string_view id)
+	{
+		return !id.empty() && id.size() <= 20 && std::all_of(id.begin(), id.end(), [](char c) { return c >= '0' && c <= '9'; });
+	}
+
+	/// Minimal JSON scanner that pulls op, s, t, d.channel_id, d.author.id and the READY/HELLO fields out of a raw gateway payload without building a document.
+	/// Strings are returned as views into the payload, still escaped, which is fine for ids and event names.
+	class GatewayScanner
+	{
+	public:
+		static bool peek(std::string_view json, GatewayPeek& result)
+		{
+			GatewayScanner scanner(json);
+			return scanner.scanObject([&](std::string_view key, GatewayScanner& s) {
+				if (key == "op")
+					return s.readInteger(result.op);
+				if (key == "s")
+					return s.readInteger(result.s);
+				if (key == "t")
+					return s.readStringOrNull(result.t);
+				if (key == "d" && s.current() == '{')
+				{
+					return s.scanObject([&](std::string_view dKey, GatewayScanner& d) {
+						if (dKey == "heartbeat_interval")
+							return d.readInteger(result.heartbeatInterval);
+						if (dKey == "session_id")
+							return d.readStringOrNull(result.sessionId);
+						if (dKey == "resume_gateway_url")
+							return d.readStringOrNull(result.resumeUrl);
+						if (dKey == "channel_id")
+							return d.readStringOrNull(result.channelId);
+						if (dKey == "author" && d.current() == '{')
+						{
+							return d.scanObject([&](std::string_view authorKey, GatewayScanner& a) {
+								if (authorKey == "id")
+									return a.readStringOrNull(result.authorId);
+								return a.skipValue();
+							});
+						}
+						return d.skipValue();
+					});
+				}
+				return s.skipValue();
+			});
+		}
+
+	private:
+		explicit GatewayScanner(std::string_view json) : _json(json), _pos(0) { }
+
+		std::string_view _json;
+		size_t _pos;
+
+		char current()
+		{
+			skipWhitespace();
+			return _pos < _json.size() ? _json[_pos] : '\0';
+		}
+
+		void skipWhitespace()
+		{
+			while (_pos < _json.size() && (_json[_pos] == ' ' || _json[_pos] == '\t' || _json[_pos] == '\n' || _json[_pos] == '\r'))
+				++_pos;
+		}
+
+		bool expect(char c)
+		{
+			if (current() != c)
+				return false;
+			++_pos;
+			return true;
+		}
+
+		template <typename Callback>
+		bool scanObject(Callback&& onKey)
+		{
+			if (!expect('{'))
+				return false;
+			if (current() == '}')
+				return expect('}');
+
+			while (true)
+			{
+				std::string_view key;
+				if (!readString(key) || !expect(':') || !onKey(key, *this))
+					return false;
+				if (current() == ',')
+				{
+					++_pos;
+					continue;
+				}
+				return expect('}');
+			}
+		}
+
+		bool readString(std::string_view& value)
+		{
+			if (!expect('"'))
+				return false;
+			const auto start = _pos;
+			while (_pos < _json.size() && _json[_pos] != '"')
+				_pos += _json[_pos] == '\\' ? 2 : 1;
+			if (_pos >= _json.size())
+				return false;
+			value = _json.substr(start, _pos - start);
+			++_pos;
+			return true;
+		}
+
+		bool readStringOrNull(std::string_view& value)
+		{
+			if (current() == '"')
+				return readString(value);
+			return skipValue();
+		}
+
+		template <typename T>
+		bool readInteger(T& value)
+		{
+			if (current() == 'n')
+				return skipValue();
+
+			bool negative = false;
+			if (_pos < _json.size() && _json[_pos] == '-')
+			{
+				negative = true;
+				++_pos;
+			}
+			if (_pos >= _json.size() || _json[_pos] < '0' || _json[_pos] > '9')
+				return false;
+
+			T result = 0;
+			while (_pos < _json.size() && _json[_pos] >= '0' && _json[_pos] <= '9')
+				result = result * 10 + (_json[_pos++] - '0');
+			value = negative ? -result : result;
+			return true;
+		}
+
+		/// Skips over any value, including nested objects and arrays
+		bool skipValue()
+		{
+			switch (current())
+			{
+			case '"':
+			{
+				std::string_view ignored;
+				return readString(ignored);
+			}
+			case '{':
+			case '[':
+			{
+				int depth = 0;
+				while (_pos < _json.size())
+				{
+					const char c = _json[_pos];
+					if (c == '"')
+					{
+						std::string_view ignored;
+						if (!readString(ignored))
+							return false;
+						continue;
+					}
+					++_pos;
+					if (c == '{' || c == '[')
+						++depth;
+					else if ((c == '}' || c == ']') && --depth == 0)
+						return true;
+				}
+				return false;
+			}
+			default:
+				// Numbers, true, false, null
+				while (_pos < _json.size() && _json[_pos] != ',' && _json[_pos] != '}' && _json[_pos] != ']')
+					++_pos;
+				return true;
+			}
+		}
+	};
+}
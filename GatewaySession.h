@@ -0,0 +1,152 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <cstdint>
+#include <optional>
+
+namespace MQ2Discord
+{
+	/// What's needed to RESUME a gateway session instead of doing a full IDENTIFY
+	struct GatewaySession
+	{
+		std::string sessionId;
+		int64_t sequence = -1;
+		std::string resumeUrl;
+
+		/// Whether this can be resumed. Sessions come back from files anyone could edit and end up in a JSON payload for the gateway, so
+		/// the id has to look like one of discord's (letters and digits) and the url has to be a plain wss:// url.
+		bool valid() const
+		{
+			if (sessionId.empty() || sequence < 0)
+				return false;
+			for (const auto c : sessionId)
+				if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+					return false;
+
+			if (resumeUrl.compare(0, 6, "wss://") != 0 || resumeUrl.size() == 6)
+				return false;
+			for (const auto c : resumeUrl)
+				if (static_cast<unsigned char>(c) <= ' ' || c == '"' || c == '\\' || c == 0x7F)
+					return false;
+			return true;
+		}
+	};
+
+	/// Keeps gateway sessions between clients: in memory while the plugin stays loaded, and in files in a directory across loads.
+	/// Sessions are keyed by character and a hash of the token, never the token itself. A session can only be used by one client at a time,
+	/// so a client starting while the previous one is still shutting down waits for it to hand the session back.
+	class GatewaySessionStore
+	{
+	public:
+		/// Key for a character's session with a token
+		static std::string key(const std::string& character, const std::string& token)
+		{
+			uint64_t hash = 14695981039346656037ull;
+			for (auto c : token)
+			{
+				hash ^= static_cast<uint8_t>(c);
+				hash *= 1099511628211ull;
+			}
+
+			char hex[17];
+			snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+			return character + "_" + hex;
+		}
+
+		/// Take the session for a key, waiting up to timeout for another client to return it. Checks the directory, if there is one, when it
+		/// isn't in memory. Returns nothing if it's still in use after the timeout, or an invalid session if there isn't one saved.
+		static std::optional<GatewaySession> checkOut(const std::filesystem::path& directory, const std::string& key, std::chrono::milliseconds timeout)
+		{
+			std::unique_lock<std::mutex> lock(mutex());
+			if (!condition().wait_for(lock, timeout, [&]() { return inUse().count(key) == 0; }))
+				return std::nullopt;
+			inUse()[key] = true;
+
+			auto it = sessions().find(key);
+			if (it != sessions().end())
+				return it->second;
+			return directory.empty() ? GatewaySession() : load(directory / (key + ".session"));
+		}
+
+		/// Hand a session back once the client is done with it. An invalid session forgets the key.
+		static void checkIn(const std::filesystem::path& directory, const std::string& key, const GatewaySession& session)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex());
+				inUse().erase(key);
+				if (session.valid())
+					sessions()[key] = session;
+				else
+					sessions().erase(key);
+				if (!directory.empty())
+					save(directory / (key + ".session"), session);
+			}
+			condition().notify_all();
+		}
+
+	private:
+		static std::mutex& mutex()
+		{
+			static std::mutex instance;
+			return instance;
+		}
+
+		static std::condition_variable& condition()
+		{
+			static std::condition_variable instance;
+			return instance;
+		}
+
+		static std::map<std::string, GatewaySession>& sessions()
+		{
+			static std::map<std::string, GatewaySession> instance;
+			return instance;
+		}
+
+		static std::map<std::string, bool>& inUse()
+		{
+			static std::map<std::string, bool> instance;
+			return instance;
+		}
+
+		/// One value per line: session id, sequence, resume url
+		static GatewaySession load(const std::filesystem::path& file)
+		{
+			GatewaySession session;
+			std::ifstream input(file);
+			std::string sequence;
+			if (!std::getline(input, session.sessionId) || !std::getline(input, sequence))
+				return {};
+			std::getline(input, session.resumeUrl);
+			try
+			{
+				session.sequence = std::stoll(sequence);
+			}
+			catch (...)
+			{
+				return {};
+			}
+			return session;
+		}
+
+		static void save(const std::filesystem::path& file, const GatewaySession& session)
+		{
+			std::error_code ec;
+			if (!session.valid())
+			{
+				std::filesystem::remove(file, ec);
+				return;
+			}
+
+			std::filesystem::create_directories(file.parent_path(), ec);
+			std::ofstream output(file, std::ios::trunc);
+			output << session.sessionId << '\n' << session.sequence << '\n' << session.resumeUrl << '\n';
+		}
+	};
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <string>
+#include <array>
+#include <cstdint>
+#include <algorithm>
+
+namespace MQ2Discord
+{
+	/// Counts of durations in microseconds, in power of two buckets: under 1us, under 2us, under 4us... and the last one is everything longer.
+	/// Not threadsafe.
+	class LatencyHistogram
+	{
+	public:
+		static constexpr size_t Buckets = 28;
+
+		void add(uint64_t us)
+		{
+			++_counts[bucket(us)];
+			++_count;
+			_total += us;
+			_max = std::max(_max, us);
+		}
+
+		uint64_t count() const
+		{
+			return _count;
+		}
+
+		uint64_t average() const
+		{
+			return _count ? _total / _count : 0;
+		}
+
+		uint64_t max() const
+		{
+			return _max;
+		}
+
+		/// Upper bound of the bucket the percentile falls in, e.g. "<64us", or "n/a" if it's empty
+		std::string percentile(double fraction) const
+		{
+			if (_count == 0)
+				return "n/a";
+
+			const auto target = static_cast<uint64_t>(fraction * _count);
+			uint64_t seen = 0;
+			for (size_t i = 0; i < Buckets - 1; ++i)
+			{
+				seen += _counts[i];
+				if (seen > target)
+					return "<" + format(uint64_t(1) << i);
+			}
+			return ">=" + format(uint64_t(1) << (Buckets - 2));
+		}
+
+		/// Microseconds, or milliseconds once they're big enough to be easier to read that way
+		static std::string format(uint64_t us)
+		{
+			return us < 10000 ? std::to_string(us) + "us" : std::to_string(us / 1000) + "ms";
+		}
+
+	private:
+		std::array<uint64_t, Buckets> _counts{};
+		uint64_t _count = 0;
+		uint64_t _total = 0;
+		uint64_t _max = 0;
+
+		static size_t bucket(uint64_t us)
+		{
+			size_t result = 0;
+			while (us > 0 && result < Buckets - 1)
+			{
+				us >>= 1;
+				++result;
+			}
+			return result;
+		}
+	};
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace MQ2Discord
+{
+	/// Fixed size string keyed cache, evicting the least recently used entry once full. Not threadsafe.
+	template <typename Value>
+	class LruCache
+	{
+	public:
+		explicit LruCache(size_t capacity) : _capacity(capacity) { }
+
+		/// Find an entry and mark it as most recently used. Returns null if it isn't cached.
+		Value * find(const std::string& key)
+		{
+			auto it = _index.find(key);
+			if (it == _index.end())
+				return nullptr;
+
+			_entries.splice(_entries.begin(), _entries, it->second);
+			return &it->second->second;
+		}
+
+		/// Add or replace an entry, evicting the least recently used one if the cache is full
+		void insert(const std::string& key, Value value)
+		{
+			if (_capacity == 0)
+				return;
+
+			auto it = _index.find(key);
+			if (it != _index.end())
+			{
+				it->second->second = std::move(value);
+				_entries.splice(_entries.begin(), _entries, it->second);
+				return;
+			}
+
+			if (_entries.size() >= _capacity)
+			{
+				_index.erase(_entries.back().first);
+				_entries.pop_back();
+			}
+
+			_entries.emplace_front(key, std::move(value));
+			_index[key] = _entries.begin();
+		}
+
+		void clear()
+		{
+			_index.clear();
+			_entries.clear();
+		}
+
+		size_t size() const
+		{
+			return _entries.size();
+		}
+
+		size_t capacity() const
+		{
+			return _capacity;
+		}
+
+	private:
+		const size_t _capacity;
+
+		/// Most recently used first
+		std::list<std::pair<std::string, Value>> _entries;
+
+		std::unordered_map<std::string, typename std::list<std::pair<std::string, Value>>::iterator> _index;
+	};
+}
@@ -1,11 +1,14 @@
 #define NONEXISTENT_OPUS
 
 #include "DiscordClient.h"
+#include "FrameBudget.h"
 #include "Config.h"
 #include <fstream>
 #include <regex>
 #include <yaml-cpp\yaml.h>
 #include <filesystem>
+#include <condition_variable>
+#include <future>
 
 #include <mq/Plugin.h>
 
@@ -25,12 +28,88 @@ VOID DiscordCmd(PSPAWNINFO pChar, PCHAR szLine);
 void Reload();
 
 std::unique_ptr<MQ2Discord::DiscordClient> client;
+
+// Old clients are handed to the reaper thread to be destroyed, so the game thread never waits for one to disconnect
+std::vector<std::unique_ptr<MQ2Discord::DiscordClient>> retiredClients;
+size_t clientsBeingReaped = 0;
+bool reaperStop = false;
+std::mutex reaperMutex;
+std::condition_variable reaperCondition;
+std::thread reaperThread;
+
+// Timings, in microseconds, to keep an eye on how long the game thread spends starting and stopping clients. Reload is the command
+// itself, swap is putting the loaded client in place on a later pulse. Load and teardown happen on other threads.
+int64_t lastReloadTime = 0;
+int64_t maxReloadTime = 0;
+int64_t lastSwapTime = 0;
+int64_t maxSwapTime = 0;
+std::atomic<int64_t> lastLoadTime{ 0 };
+std::atomic<int64_t> lastTeardownTime{ 0 };
+
 bool disabled = false;
 bool debug = false;
-std::queue<std::string> commands;
+// Commands from discord. Each batch is queued as a whole, and runs in order over as many pulses as commandsPerPulse needs.
+struct CommandBatch
+{
+	std::vector<std::string> commands;
+	size_t next = 0;
+
+	/// Called once every command has run, may be empty
+	std::function<void()> done;
+};
+std::queue<CommandBatch> commands;
 std::mutex commandsMutex;
+uint32_t commandsPerPulse = 0;
+
+// Time spent in each hook per frame. Once a frame's budget is spent, lines are only checked for notifications, and the rest of
+// their matching is put off to a later frame, or skipped if deferMatching is off.
+MQ2Discord::FrameBudget frameBudget;
+bool deferMatching = true;
+struct DeferredLine
+{
+	std::string text;
+	int color;
+
+	/// When the line first reached the plugin, so its latency includes the wait
+	uint64_t hookTime;
+};
+std::queue<DeferredLine> deferredLines;
+constexpr size_t MaxDeferredLines = 1000;
 std::queue<std::string> messages;
 std::mutex messagesMutex;
+
+// Recent chat for !tail and !grep, kept across reloads as long as its size doesn't change. Null if history_kb is 0.
+std::shared_ptr<MQ2Discord::ChatHistory> history;
+
+// Reloads build the new client on a loader thread, so reading the config, building filters and starting connections stay off the main
+// thread, and OnPulse puts it in place once it's ready. One load runs at a time: a reload asked for during one starts when it's done.
+struct LoadContext
+{
+	std::string serverCharacter;
+	std::string serverShortName;
+	std::string classShortName;
+	std::string configDirectory;
+
+	/// The current history, kept if its size hasn't changed
+	std::shared_ptr<MQ2Discord::ChatHistory> history;
+};
+struct LoadResult
+{
+	/// Null if the config had errors or no channels for this character
+	std::unique_ptr<MQ2Discord::DiscordClient> client;
+
+	/// Whether the config could be read at all, and so whether the settings below are from it
+	bool configLoaded = false;
+	std::shared_ptr<MQ2Discord::ChatHistory> history;
+	uint32_t commandsPerPulse = 0;
+	uint32_t frameBudgetUs = 0;
+	bool deferMatching = true;
+};
+std::future<LoadResult> pendingLoad;
+
+// Whether the pending load's client should be used (false once we've left the game), and whether another reload was asked for since it started
+bool clientWanted = false;
+bool reloadWanted = false;
 DWORD mainThreadId;
 
 void OutputMessage(const char * prepend, const char * format, va_list args)
@@ -88,17 +167,83 @@ void OutputNormal(const char * format, ...)
 	va_end(args);
 }
 
-void ProcessMessage(std::string Message)
+int64_t MicrosecondsSince(std::chrono::steady_clock::time_point start)
 {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ReaperThread()
+{
+	std::unique_lock<std::mutex> lock(reaperMutex);
+	while (true)
+	{
+		reaperCondition.wait(lock, [] { return reaperStop || !retiredClients.empty(); });
+		if (retiredClients.empty())
+			return;
+
+		auto clients = std::move(retiredClients);
+		retiredClients.clear();
+		clientsBeingReaped = clients.size();
+		lock.unlock();
+
+		const auto start = std::chrono::steady_clock::now();
+		clients.clear();
+		lastTeardownTime = MicrosecondsSince(start);
+		OutputDebug("Client teardown took %lldus", lastTeardownTime.load());
+
+		lock.lock();
+		clientsBeingReaped = 0;
+		reaperCondition.notify_all();
+	}
+}
+
+// Stop a client and hand it to the reaper thread to finish disconnecting and be destroyed
+void RetireClient(std::unique_ptr<MQ2Discord::DiscordClient> oldClient)
+{
+	if (!oldClient)
+		return;
+
+	oldClient->Stop();
+	std::lock_guard<std::mutex> lock(reaperMutex);
+	retiredClients.push_back(std::move(oldClient));
+	reaperCondition.notify_all();
+}
+
+void ProcessMessage(const char* Message, int Color, uint64_t hookTime = 0)
+{
+	// Colours no channel wants are thrown away before anything else happens. Only the history, if it's turned on, needs them.
+	const bool wanted = client && client->acceptsColor(Color);
+	if (!wanted && !history)
+		return;
+
 	if (client && !disabled && GetGameState() == GAMESTATE_INGAME)
 	{
 		char myMessage[MAX_STRING] = { 0 };
-		strcpy_s(myMessage, Message.c_str());
+		strcpy_s(myMessage, Message);
 		// Should be okay to modify the message since it's a copy.
 		StripTextLinks(myMessage);
+		if (history)
+			history->add(myMessage);
+		if (!wanted)
+			return;
 		// Resize the string to match the first null terminator.
 		//Message.erase(std::find(Message.begin(), Message.end(), '\0'), Message.end());
-		client->enqueueIfMatch(myMessage);
+		if (!frameBudget.overBudget())
+		{
+			client->enqueueIfMatch(myMessage, Color, MQ2Discord::MatchScope::All, hookTime);
+			return;
+		}
+
+		client->enqueueIfMatch(myMessage, Color, MQ2Discord::MatchScope::Priority, hookTime);
+		if (deferMatching && deferredLines.size() < MaxDeferredLines)
+		{
+			deferredLines.push({ myMessage, Color, hookTime });
+			frameBudget.deferred();
+		}
+		else
+		{
+			frameBudget.shed();
+		}
 	}
 }
 
@@ -110,14 +255,104 @@ std::string ParseMacroDataString(const std::string& input)
 	return buffer;
 }
 
-void OnCommand(std::string command)
+void OnCommands(std::vector<std::string> batch, std::function<void()> done)
 {
-	OutputDebug("OnCommand: %s", command.c_str());
+	if (batch.empty())
+		return;
+	OutputDebug("OnCommands: %s (%d total)", batch.front().c_str(), static_cast<int>(batch.size()));
 	std::lock_guard<std::mutex> _lock(commandsMutex);
-	commands.emplace(command);
+	commands.push({ std::move(batch), 0, std::move(done) });
 }
 
-void SetDefaults(DiscordConfig& config)
+// Chat colours that can be used by name in a channel's colors/exclude_colors
+const std::map<std::string, std::vector<int>> ChatColorNames = {
+	{ "say", { USERCOLOR_SAY } },
+	{ "tell", { USERCOLOR_TELL } },
+	{ "group", { USERCOLOR_GROUP } },
+	{ "guild", { USERCOLOR_GUILD } },
+	{ "ooc", { USERCOLOR_OOC } },
+	{ "auction", { USERCOLOR_AUCTION } },
+	{ "shout", { USERCOLOR_SHOUT } },
+	{ "emote", { USERCOLOR_EMOTE } },
+	{ "raid", { USERCOLOR_RAID } },
+	{ "chat_channel", { USERCOLOR_CHAT_CHANNEL } },
+	{ "spells", { USERCOLOR_SPELLS } },
+	{ "others_spells", { USERCOLOR_OTHERS_SPELLS } },
+	{ "spell_failure", { USERCOLOR_SPELL_FAILURE } },
+	{ "spell_worn_off", { USERCOLOR_SPELL_WORN_OFF } },
+	{ "spell_crit", { USERCOLOR_SPELL_CRIT } },
+	{ "non_melee", { USERCOLOR_NON_MELEE } },
+	{ "damageshield", { USERCOLOR_DAMAGESHIELD } },
+	{ "you_hit_other", { USERCOLOR_YOU_HIT_OTHER } },
+	{ "other_hit_you", { USERCOLOR_OTHER_HIT_YOU } },
+	{ "you_miss_other", { USERCOLOR_YOU_MISS_OTHER } },
+	{ "other_miss_you", { USERCOLOR_OTHER_MISS_YOU } },
+	{ "other_hit_other", { USERCOLOR_OTHER_HIT_OTHER } },
+	{ "other_miss_other", { USERCOLOR_OTHER_MISS_OTHER } },
+	{ "melee_crit", { USERCOLOR_MELEE_CRIT } },
+	{ "melee", { USERCOLOR_YOU_HIT_OTHER, USERCOLOR_OTHER_HIT_YOU, USERCOLOR_YOU_MISS_OTHER, USERCOLOR_OTHER_MISS_YOU,
+		USERCOLOR_OTHER_HIT_OTHER, USERCOLOR_OTHER_MISS_OTHER, USERCOLOR_MELEE_CRIT } },
+	{ "npc_rampage", { USERCOLOR_NPC_RAMPAGE } },
+	{ "npc_flurry", { USERCOLOR_NPC_FLURRY } },
+	{ "npc_enrage", { USERCOLOR_NPC_ENRAGE } },
+	{ "your_death", { USERCOLOR_YOUR_DEATH } },
+	{ "other_death", { USERCOLOR_OTHER_DEATH } },
+	{ "skills", { USERCOLOR_SKILLS } },
+	{ "disciplines", { USERCOLOR_DISCIPLINES } },
+	{ "duels", { USERCOLOR_DUELS } },
+	{ "default", { USERCOLOR_DEFAULT } },
+	{ "merchant_offer", { USERCOLOR_MERCHANT_OFFER } },
+	{ "merchant_exchange", { USERCOLOR_MERCHANT_EXCHANGE } },
+	{ "who", { USERCOLOR_WHO } },
+	{ "yell", { USERCOLOR_YELL } },
+	{ "money_split", { USERCOLOR_MONEY_SPLIT } },
+	{ "loot", { USERCOLOR_LOOT } },
+	{ "random", { USERCOLOR_RANDOM } },
+	{ "too_far_away", { USERCOLOR_TOO_FAR_AWAY } },
+	{ "pet", { USERCOLOR_PET } },
+	{ "pet_spells", { USERCOLOR_PET_SPELLS } },
+	{ "pet_responses", { USERCOLOR_PET_RESPONSES } },
+	{ "leader", { USERCOLOR_LEADER } },
+	{ "focus", { USERCOLOR_FOCUS } },
+	{ "xp", { USERCOLOR_XP } },
+	{ "system", { USERCOLOR_SYSTEM } },
+	{ "item_speech", { USERCOLOR_ITEM_SPEECH } },
+	{ "stun", { USERCOLOR_STUN } },
+	{ "echo_say", { USERCOLOR_ECHO_SAY } },
+	{ "echo_tell", { USERCOLOR_ECHO_TELL } },
+	{ "echo_group", { USERCOLOR_ECHO_GROUP } },
+	{ "echo_guild", { USERCOLOR_ECHO_GUILD } },
+};
+
+// Replaces colour names with their numbers, leaving numbers as they are. Unknown names are added to errors: dropping them could leave the
+// list empty, which would accept every colour instead of the few that were meant.
+std::vector<std::string> ResolveChatColors(const std::vector<std::string>& colors, const std::string& channelName, std::vector<std::string>& errors)
+{
+	std::vector<std::string> results;
+	for (const auto& color : colors)
+	{
+		if (!color.empty() && std::all_of(color.begin(), color.end(), [](unsigned char c) { return isdigit(c); }))
+		{
+			results.push_back(color);
+			continue;
+		}
+
+		std::string name = color;
+		std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+		const auto found = ChatColorNames.find(name);
+		if (found == ChatColorNames.end())
+		{
+			errors.push_back("Unknown chat color \ay" + color + "\aw on channel \ay" + channelName + "\aw");
+			continue;
+		}
+
+		for (auto number : found->second)
+			results.push_back(std::to_string(number));
+	}
+	return results;
+}
+
+void SetDefaults(DiscordConfig& config, const std::string& serverCharacter)
 {
 	config.token = "YourTokenHere";
 	config.user_ids.emplace_back("YourUserIdHere");
@@ -129,7 +364,7 @@ void SetDefaults(DiscordConfig& config)
 	charChannel.prefix = "";
 	charChannel.allow_commands = true;
 	charChannel.show_command_response = 2000;
-	config.characters[ParseMacroDataString("${EverQuest.Server}_${Me.Name}")].push_back(charChannel);
+	config.characters[serverCharacter].push_back(charChannel);
 
 	// A channel for a group of characters that relays deaths
 	ChannelConfig groupChannel;
@@ -141,7 +376,7 @@ void SetDefaults(DiscordConfig& config)
 	groupChannel.show_command_response = 0;
 	GroupConfig group;
 	group.name = "YourGroup";
-	group.characters.emplace_back(ParseMacroDataString("${EverQuest.Server}_${Me.Name}"));
+	group.characters.emplace_back(serverCharacter);
 	group.characters.emplace_back("server_OtherCharInGroup");
 	group.characters.emplace_back("server_OneMore");
 	group.channels.emplace_back(groupChannel);
@@ -167,17 +402,17 @@ void WriteConfig(const DiscordConfig& config, const std::string& filename)
 	fout << node;
 }
 
-DiscordConfig GetConfig()
+DiscordConfig GetConfig(const LoadContext& context)
 {
 	// Load existing config if it exists
-	const std::filesystem::path configFile = std::filesystem::path(gPathConfig) / "MQ2Discord.yaml";
+	const std::filesystem::path configFile = std::filesystem::path(context.configDirectory) / "MQ2Discord.yaml";
 	std::error_code ec_exists;
 	if (std::filesystem::exists(configFile, ec_exists))
 		return YAML::LoadFile(configFile.string()).as<DiscordConfig>();
 
 	// If old .json configs exist, convert them
 	std::map<std::string, YAML::Node> jsonConfigs;
-	for (const auto & file : std::filesystem::directory_iterator(gPathConfig))
+	for (const auto & file : std::filesystem::directory_iterator(context.configDirectory))
 	{
 		const auto filename = file.path().filename().string();
 		const std::regex re("MQ2Discord_(.*)\\.json");
@@ -228,28 +463,38 @@ DiscordConfig GetConfig()
 
 	// Otherwise, create a default config
 	DiscordConfig config;
-	SetDefaults(config);
+	SetDefaults(config, context.serverCharacter);
 	WriteConfig(config, configFile.string());
 	OutputNormal("Created a default configuration. Edit this, then do \ag/discord reload");
 	return config;
 }
 
-void Reload()
+LoadResult LoadClient(const LoadContext& context)
 {
-	if (client)
-		client.reset();
+	const auto start = std::chrono::steady_clock::now();
+	LoadResult result;
+	result.history = context.history;
 
 	DiscordConfig config;
 	try
 	{
-		config = GetConfig();
+		config = GetConfig(context);
 	}
 	catch (std::exception& e)
 	{
 		OutputError("Failed to load config, %s", e.what());
-		return;
+		return result;
 	}
 
+	result.configLoaded = true;
+	result.commandsPerPulse = config.commands_per_pulse;
+	if (config.history_kb == 0)
+		result.history.reset();
+	else if (!result.history || result.history->capacityKb() != config.history_kb)
+		result.history = std::make_shared<MQ2Discord::ChatHistory>(config.history_kb);
+	result.frameBudgetUs = config.frame_budget_us;
+	result.deferMatching = config.frame_budget_mode != "shed";
+
 	for (const auto& warning : config.warnings())
 		OutputWarning(warning.c_str());
 
@@ -260,17 +505,10 @@ void Reload()
 	if (!errors.empty())
 	{
 		OutputNormal("Config not loaded due to errors, please fix them and \ag/discord reload");
-		return;
+		return result;
 	}
 
-	//const std::string server = EQADDR_SERVERNAME;
-	//const std::string server_character = server + "_" + GetCharInfo()->Name;
-	//const std::string classShortName = pEverQuest->GetClassThreeLetterCode(((PSPAWNINFO)pCharSpawn)->mActorClient.Class);
-
-	const std::string server = ParseMacroDataString("${EverQuest.Server}");
-	const std::string server_character = server + "_" + ParseMacroDataString("${Me.Name}");
-	const std::string classShortName = ParseMacroDataString("${Me.Class.ShortName}");
-
+	const auto& server_character = context.serverCharacter;
 	std::vector<ChannelConfig> channels;
 
 	// Character's own channels
@@ -278,12 +516,12 @@ void Reload()
 		channels.insert(channels.end(), config.characters[server_character].begin(), config.characters[server_character].end());
 
 	// Server channels
-	if (config.servers.find(GetServerShortName()) != config.servers.end())
-		channels.insert(channels.end(), config.servers[GetServerShortName()].begin(), config.servers[GetServerShortName()].end());
+	if (config.servers.find(context.serverShortName) != config.servers.end())
+		channels.insert(channels.end(), config.servers[context.serverShortName].begin(), config.servers[context.serverShortName].end());
 
 	// Class channels
-	if (config.classes.find(classShortName) != config.classes.end())
-		channels.insert(channels.end(), config.classes[classShortName].begin(), config.classes[classShortName].end());
+	if (config.classes.find(context.classShortName) != config.classes.end())
+		channels.insert(channels.end(), config.classes[context.classShortName].begin(), config.classes[context.classShortName].end());
 
 	// Groups
 	for (const auto& group : config.groups)
@@ -296,33 +534,171 @@ void Reload()
 	if (channels.empty())
 	{
 		OutputWarning("No channels configured for this character");
-		return;
+		return result;
 	}
 
+	std::vector<std::string> colorErrors;
 	for (auto &channel : channels)
 	{
-		if (!channel.prefix.empty())
-		{
-			// Make prefixes end with a space if they don't already
-			if (channel.prefix.back() != ' ')
-				channel.prefix.append(" ");
-			channel.prefix = ParseMacroDataString(channel.prefix);
-		}
+		channel.colors = ResolveChatColors(channel.colors, channel.name, colorErrors);
+		channel.exclude_colors = ResolveChatColors(channel.exclude_colors, channel.name, colorErrors);
+
+		// Make prefixes end with a space if they don't already. MQ data in them is parsed on the main thread each time they're used.
+		if (!channel.prefix.empty() && channel.prefix.back() != ' ')
+			channel.prefix.append(" ");
 
 		// FIXME:  A lot of allocations happening here.
-		// Add #*# at the start/end of any filters that don't have it already
+		// Add #*# at the start/end of any filters that don't have it already. Regular expressions match anywhere in the line already.
 		for (auto& filter : channel.allowed)
-			if (filter.substr(0, 3) != "#*#" && filter.substr(filter.length() - 3, 3) != "#*#")
+			if (!MQ2Discord::RegexSet::isRegexFilter(filter) && filter.substr(0, 3) != "#*#" && filter.substr(filter.length() - 3, 3) != "#*#")
 				filter = "#*#" + filter + "#*#";
 		for (auto& filter : channel.blocked)
-			if (filter.substr(0, 3) != "#*#" && filter.substr(filter.length() - 3, 3) != "#*#")
+			if (!MQ2Discord::RegexSet::isRegexFilter(filter) && filter.substr(0, 3) != "#*#" && filter.substr(filter.length() - 3, 3) != "#*#")
 				filter = "#*#" + filter + "#*#";
 		for (auto& filter : channel.notify)
-			if (filter.substr(0, 3) != "#*#" && filter.substr(filter.length() - 3, 3) != "#*#")
+			if (!MQ2Discord::RegexSet::isRegexFilter(filter) && filter.substr(0, 3) != "#*#" && filter.substr(filter.length() - 3, 3) != "#*#")
 				filter = "#*#" + filter + "#*#";
 	}
 
-	client = std::make_unique<MQ2Discord::DiscordClient>(config.token, config.user_ids, channels, OnCommand, ParseMacroDataString, OutputError, OutputWarning, OutputNormal, OutputDebug);
+	if (!colorErrors.empty())
+	{
+		for (const auto& error : colorErrors)
+			OutputError(error.c_str());
+		OutputNormal("Config not loaded due to errors, please fix them and \ag/discord reload");
+		return result;
+	}
+
+	const auto tokenAssignment = config.token_assignment == "budget" ? MQ2Discord::TokenAssignment::Budget : MQ2Discord::TokenAssignment::Hash;
+	// The client connects in the background, so this returns straight away
+	result.client = std::make_unique<MQ2Discord::DiscordClient>(config.allTokens(), tokenAssignment, config.global_rate_limit, config.user_ids, channels, config.verdict_cache_size, config.verdict_cache_verify,
+		config.resume_sessions ? server_character : "", (std::filesystem::path(context.configDirectory) / "MQ2Discord_sessions").string(), result.history, OnCommands, ParseMacroDataString, OutputError, OutputWarning, OutputNormal, OutputDebug);
+
+	lastLoadTime = MicrosecondsSince(start);
+	return result;
+}
+
+// Start building a client on a loader thread. Only what needs MQ is looked up here, on the main thread.
+void StartLoad()
+{
+	LoadContext context;
+	context.serverCharacter = ParseMacroDataString("${EverQuest.Server}") + "_" + ParseMacroDataString("${Me.Name}");
+	context.serverShortName = GetServerShortName();
+	context.classShortName = ParseMacroDataString("${Me.Class.ShortName}");
+	context.configDirectory = gPathConfig;
+	context.history = history;
+	pendingLoad = std::async(std::launch::async, LoadClient, std::move(context));
+}
+
+// Put a finished load's client in place, or throw it away if it's been superseded. Call from the main thread once pendingLoad is ready.
+void FinishLoad()
+{
+	const auto start = std::chrono::steady_clock::now();
+	auto result = pendingLoad.get();
+	if (clientWanted && !reloadWanted)
+	{
+		if (result.configLoaded)
+		{
+			commandsPerPulse = result.commandsPerPulse;
+			history = std::move(result.history);
+			frameBudget.setBudget(result.frameBudgetUs);
+			deferMatching = result.deferMatching;
+		}
+		client = std::move(result.client);
+	}
+	else
+	{
+		RetireClient(std::move(result.client));
+	}
+
+	if (reloadWanted)
+	{
+		reloadWanted = false;
+		StartLoad();
+	}
+
+	lastSwapTime = MicrosecondsSince(start);
+	maxSwapTime = std::max(maxSwapTime, lastSwapTime);
+}
+
+void Reload()
+{
+	const auto start = std::chrono::steady_clock::now();
+	RetireClient(std::move(client));
+	clientWanted = true;
+	if (pendingLoad.valid())
+		reloadWanted = true;
+	else
+		StartLoad();
+
+	lastReloadTime = MicrosecondsSince(start);
+	maxReloadTime = std::max(maxReloadTime, lastReloadTime);
+	OutputDebug("Reload took %lldus on the main thread", lastReloadTime);
+}
+
+void __stdcall BenchMatch(unsigned int ID, void * pData, PBLECHVALUE pValues)
+{
+	++*static_cast<size_t*>(pData);
+}
+
+// Time a stack of Blech filters against the single re: filter that does the same job, on a mix of lines that do and don't match
+void BenchFilters()
+{
+	static constexpr const char * Names[] = { "Alaric", "Brenna", "Cadoc", "Delphine", "Eamon", "Fiora", "Gareth", "Hilda", "Ivor", "Jessamy", "Kellan", "Lorna",
+		"Magnus", "Nerys", "Osric", "Petra", "Quinlan", "Rowena", "Soren", "Tamsin", "Ulric", "Vesna", "Wystan", "Yseult" };
+	static constexpr int Passes = 200;
+
+	Blech blech('#', '|', MQ2DataVariableLookup);
+	size_t blechMatches = 0;
+	std::string pattern = "^(";
+	for (const auto * name : Names)
+	{
+		blech.AddEvent((std::string(name) + " tells you, #*#").c_str(), BenchMatch, &blechMatches);
+		pattern += std::string(pattern.size() > 2 ? "|" : "") + name;
+	}
+	pattern += ") tells you, ";
+
+	MQ2Discord::RegexSet regex;
+	std::string error;
+	if (!regex.add(pattern, error))
+	{
+		OutputError("Couldn't compile the benchmark's regular expression: %s", error.c_str());
+		return;
+	}
+
+	std::vector<std::string> lines;
+	for (size_t i = 0; i < std::size(Names); ++i)
+	{
+		lines.push_back(std::string(Names[i]) + " tells you, 'Incoming, " + std::to_string(i) + " mobs'");
+		lines.push_back(std::string(Names[i]) + " says, 'Hail, " + Names[(i + 1) % std::size(Names)] + "'");
+		lines.push_back("You hit a gnoll pup for " + std::to_string(i * 37 % 500) + " points of damage.");
+		lines.push_back("A gnoll pup tells you, 'I will " + std::to_string(i) + " you'");
+	}
+
+	char buffer[MAX_STRING] = { 0 };
+	const auto blechStart = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < Passes; ++pass)
+	{
+		for (const auto& line : lines)
+		{
+			strcpy_s(buffer, line.c_str());
+			blech.Feed(buffer);
+		}
+	}
+	const auto blechTime = MicrosecondsSince(blechStart);
+
+	size_t regexMatches = 0;
+	std::vector<bool> matches;
+	const auto regexStart = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < Passes; ++pass)
+		for (const auto& line : lines)
+			regexMatches += regex.match(line.c_str(), matches) ? 1 : 0;
+	const auto regexTime = MicrosecondsSince(regexStart);
+
+	const auto fed = static_cast<double>(Passes * lines.size());
+	OutputNormal("Blech, %d filters: %.2fus per line, %d matches", static_cast<int>(std::size(Names)), blechTime / fed, static_cast<int>(blechMatches));
+	OutputNormal("re:, 1 filter: %.2fus per line, %d matches", regexTime / fed, static_cast<int>(regexMatches));
+	if (blechMatches != regexMatches)
+		OutputWarning("The two disagree on which lines match");
 }
 
 void DiscordCmd(PSPAWNINFO pChar, PCHAR szLine)
@@ -339,6 +715,41 @@ void DiscordCmd(PSPAWNINFO pChar, PCHAR szLine)
 	{
 		client->Stop();
 	}
+	else if (!_stricmp(buffer, "stats"))
+	{
+		OutputNormal("Main thread: reload last %lldus, max %lldus. Swap last %lldus, max %lldus", lastReloadTime, maxReloadTime, lastSwapTime, maxSwapTime);
+		OutputNormal("Other threads: load last %lldus, teardown last %lldus", lastLoadTime.load(), lastTeardownTime.load());
+		for (const auto& line : frameBudget.stats())
+			OutputNormal(line.c_str());
+		if (!client)
+		{
+			OutputWarning("Not connected");
+			return;
+		}
+		for (const auto& line : client->stats())
+			OutputNormal(line.c_str());
+	}
+	else if (!_stricmp(buffer, "trace"))
+	{
+		if (!client)
+		{
+			OutputWarning("Not connected");
+			return;
+		}
+
+		// Open in chrome://tracing or ui.perfetto.dev
+		const auto file = std::filesystem::path(gPathLogs) / "MQ2Discord_trace.json";
+		std::ofstream output(file, std::ios::trunc);
+		output << client->traceJson();
+		if (output)
+			OutputNormal("Wrote the last %d lines' trace to %s", static_cast<int>(MQ2Discord::LatencyTracer::Capacity), file.string().c_str());
+		else
+			OutputError("Couldn't write %s", file.string().c_str());
+	}
+	else if (!_stricmp(buffer, "bench"))
+	{
+		BenchFilters();
+	}
 	else if (!_stricmp(buffer, "debug"))
 	{
 		debug = !debug;
@@ -352,7 +763,7 @@ void DiscordCmd(PSPAWNINFO pChar, PCHAR szLine)
 		{
 			strLine = strLine.substr((strBuffer).length() + 1);
 			OutputDebug("Processing: %s", strLine.c_str());
-			ProcessMessage(strLine);
+			ProcessMessage(strLine.c_str(), -1);
 		}
 		else
 		{
@@ -361,43 +772,95 @@ void DiscordCmd(PSPAWNINFO pChar, PCHAR szLine)
 	}
 	else
 	{
-		OutputWarning("Invalid command.  Valid commands are process, reload, and for debugging: debug, stop.");
+		OutputWarning("Invalid command.  Valid commands are process, reload, stats, trace, and for debugging: bench, debug, stop.");
 	}
 }
 
 PLUGIN_API void InitializePlugin()
 {
 	mainThreadId = GetCurrentThreadId();
+	reaperThread = std::thread(ReaperThread);
 	AddCommand("/discord", DiscordCmd);
 }
 
 PLUGIN_API void ShutdownPlugin()
 {
-	if (client)
+	RetireClient(std::move(client));
+
+	// A load still in progress is waited for, then its client is retired with the rest
+	clientWanted = false;
+	reloadWanted = false;
+	if (pendingLoad.valid())
+		RetireClient(pendingLoad.get().client);
+
+	// Everything the reaper runs is code in this plugin, so it has to have finished before the plugin unloads. Clients stop sending once
+	// their shutdown deadline passes, so the wait is normally that long at most, plus any request that was already in flight.
 	{
-		client->Stop();
-		while(!client->IsStopped())
+		std::unique_lock<std::mutex> lock(reaperMutex);
+		if (!reaperCondition.wait_for(lock, MQ2Discord::DiscordClient::ShutdownTimeout + std::chrono::seconds(1),
+			[] { return retiredClients.empty() && clientsBeingReaped == 0; }))
 		{
-			// Wait until client is stopped.
+			OutputWarning("Discord clients are taking a while to shut down, waiting for them");
 		}
-		client.reset();
+		reaperStop = true;
+		reaperCondition.notify_all();
 	}
+	if (reaperThread.joinable())
+		reaperThread.join();
+
 	RemoveCommand("/discord");
 }
 
 PLUGIN_API void OnPulse()
 {
-	// Execute any queued commands
-	while (true)
+	frameBudget.beginFrame();
+	MQ2Discord::FrameBudget::Timer timer(frameBudget, MQ2Discord::FrameBudget::Hook::Pulse);
+
+	// Put a newly loaded client in place
+	if (pendingLoad.valid() && pendingLoad.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		FinishLoad();
+
+	// Catch up on matching that busy frames put off, for as long as this one has budget
+	while (!deferredLines.empty() && !frameBudget.overBudget(timer.elapsed()))
 	{
-		std::lock_guard<std::mutex> lock(commandsMutex);
+		if (client)
+		{
+			const auto& line = deferredLines.front();
+			client->enqueueIfMatch(line.text, line.color, MQ2Discord::MatchScope::Deferred, line.hookTime);
+		}
+		deferredLines.pop();
+	}
 
-		if (commands.empty())
-			break;
+	// Answer any queries from discord that need MQ, all at once, and post any rollups that are due
+	if (client)
+	{
+		client->processEvaluations();
+		client->postRollups();
+	}
+
+	// Execute queued commands, at most commandsPerPulse of them if it's set
+	for (uint32_t executed = 0; commandsPerPulse == 0 || executed < commandsPerPulse; ++executed)
+	{
+		std::string command;
+		std::function<void()> done;
+		{
+			std::lock_guard<std::mutex> lock(commandsMutex);
+			if (commands.empty())
+				break;
+
+			auto& batch = commands.front();
+			command = std::move(batch.commands[batch.next++]);
+			if (batch.next == batch.commands.size())
+			{
+				done = std::move(batch.done);
+				commands.pop();
+			}
+		}
 
-		OutputDebug("OnPulse: %s", commands.front().c_str());
-		EzCommand(commands.front().c_str());
-		commands.pop();
+		OutputDebug("OnPulse: %s", command.c_str());
+		EzCommand(command.c_str());
+		if (done)
+			done();
 	}
 
 	// Output any queued messages
@@ -416,14 +879,18 @@ PLUGIN_API void OnPulse()
 
 }
 
+// Filter is the chat filter setting the game checks to decide whether to show the line. Channels choose lines by colour, which is what
+// their colors and exclude_colors name, so it isn't used.
 PLUGIN_API void OnWriteChatColor(const char* Line, int Color, int Filter)
 {
-	ProcessMessage(Line);
+	MQ2Discord::FrameBudget::Timer timer(frameBudget, MQ2Discord::FrameBudget::Hook::WriteChatColor);
+	ProcessMessage(Line, Color, MQ2Discord::LatencyTracer::now());
 }
 
 PLUGIN_API bool OnIncomingChat(const char* Line, DWORD Color)
 {
-	ProcessMessage(Line);
+	MQ2Discord::FrameBudget::Timer timer(frameBudget, MQ2Discord::FrameBudget::Hook::IncomingChat);
+	ProcessMessage(Line, static_cast<int>(Color), MQ2Discord::LatencyTracer::now());
 	return false;
 }
 
@@ -435,10 +902,15 @@ PLUGIN_API void SetGameState(int GameState)
 	}
 	else
 	{
+		// A load that's still going is thrown away when it finishes
+		clientWanted = false;
+		reloadWanted = false;
 		if (client)
 		{
+			const auto start = std::chrono::steady_clock::now();
 			client->enqueueAll("Disconnecting, no longer in game");
-			client.reset();
+			RetireClient(std::move(client));
+			OutputDebug("SetGameState took %lldus", MicrosecondsSince(start));
 		}
 	}
 }
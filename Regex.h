@@ -0,0 +1,762 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <bitset>
+#include <map>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cctype>
+
+namespace MQ2Discord
+{
+	/// Regular expressions compiled together into one automaton, which finds every pattern that matches somewhere in a line in a single pass.
+	/// Patterns become a Thompson NFA, and matching walks a DFA built from it lazily, so a line takes time linear in its length whatever the
+	/// patterns are. std::regex backtracks, and can take exponential time on the wrong pattern and line.
+	///
+	/// The price is anything that needs backtracking: no backreferences, lookaround, word boundaries or captures. What's supported is
+	/// . [...] [^...] \d \w \s \D \W \S, escapes, ( ) (?: ) | * + ? {n} {n,} {n,m}, ^ and $, and (?i) at the very start to ignore case.
+	/// Not threadsafe, even to match, as DFA states are built the first time a line needs them.
+	class RegexSet
+	{
+	public:
+		/// Filters starting with this are regular expressions, not Blech patterns
+		static constexpr const char * FilterPrefix = "re:";
+
+		static bool isRegexFilter(const std::string& filter)
+		{
+			return filter.compare(0, 3, FilterPrefix) == 0;
+		}
+
+		/// Why a pattern can't be compiled, or empty if it can
+		static std::string check(const std::string& pattern)
+		{
+			RegexSet set;
+			std::string error;
+			set.add(pattern, error);
+			return error;
+		}
+
+		/// Compile a pattern into the set as the next index. If it can't be compiled, sets error and leaves the set as it was.
+		bool add(const std::string& pattern, std::string& error)
+		{
+			Parser parser(pattern);
+			auto root = parser.parse();
+			if (!parser.error.empty())
+			{
+				error = parser.error;
+				return false;
+			}
+
+			const auto start = _program.size();
+			emit(*root);
+			if (_program.size() >= MaxInstructions)
+			{
+				_program.resize(start);
+				error = "pattern is too big once repeats are expanded";
+				return false;
+			}
+
+			Instruction match;
+			match.op = Op::Match;
+			match.x = static_cast<int>(_patterns++);
+			_program.push_back(match);
+			_starts.push_back(static_cast<int>(start));
+
+			// States built so far don't know about the new pattern
+			clearStates();
+			return true;
+		}
+
+		size_t size() const
+		{
+			return _patterns;
+		}
+
+		/// Find which patterns match somewhere in text. matches is resized to size(), with true for each one that did.
+		/// Returns whether any did.
+		bool match(const char * text, std::vector<bool>& matches)
+		{
+			matches.assign(_patterns, false);
+			if (_patterns == 0)
+				return false;
+
+			bool any = false;
+			const auto accept = [&](const std::vector<uint32_t>& patterns) {
+				for (auto pattern : patterns)
+					matches[pattern] = true;
+				any |= !patterns.empty();
+			};
+
+			if (_start < 0)
+			{
+				_closure.clear();
+				++_generation;
+				for (auto start : _starts)
+					addClosure(start, true, false, _closure);
+				_start = stateFor(_closure, true);
+			}
+
+			auto state = _start;
+			accept(_states[state].accepts);
+			for (auto p = reinterpret_cast<const unsigned char *>(text); *p; ++p)
+			{
+				auto next = _states[state].next[*p];
+				if (next < 0)
+				{
+					// Too many states means the patterns and lines are exploring a lot of the DFA. Start over from the current state
+					// rather than let it grow without limit, which keeps memory bounded at the cost of rebuilding states.
+					if (_states.size() >= MaxStates)
+					{
+						auto instructions = _states[state].instructions;
+						const bool atStart = _states[state].atStart;
+						clearStates();
+						state = stateFor(instructions, atStart);
+					}
+					next = step(state, *p);
+					_states[state].next[*p] = next;
+				}
+				state = next;
+				accept(_states[state].accepts);
+			}
+			accept(endAccepts(state));
+			return any;
+		}
+
+	private:
+		/// Most NFA instructions in a set, to stop something like (a{1000}){1000} using all the memory
+		static constexpr size_t MaxInstructions = 50000;
+
+		/// Most DFA states kept at once. Each is about 1KB.
+		static constexpr size_t MaxStates = 4096;
+
+		/// Deepest nesting of groups
+		static constexpr int MaxDepth = 100;
+
+		/// Biggest count in {n,m}
+		static constexpr int MaxRepeat = 1000;
+
+		using Bytes = std::bitset<256>;
+
+		enum class Op : uint8_t
+		{
+			/// Consume a byte in the set
+			Byte,
+			/// Carry on at both x and y
+			Split,
+			/// Carry on at x
+			Jump,
+			/// Only at the start of the line
+			Begin,
+			/// Only at the end of the line
+			End,
+			/// Pattern x has matched
+			Match
+		};
+
+		struct Instruction
+		{
+			Op op = Op::Byte;
+			int x = 0;
+			int y = 0;
+			Bytes bytes;
+		};
+
+		struct Node
+		{
+			enum class Type
+			{
+				Empty,
+				Bytes,
+				Concat,
+				Alternate,
+				Repeat,
+				Begin,
+				End
+			};
+
+			explicit Node(Type type) : type(type) { }
+
+			Type type;
+			Bytes bytes;
+			std::vector<std::unique_ptr<Node>> children;
+
+			/// Repeat counts. max is -1 for no limit.
+			int min = 0;
+			int max = -1;
+		};
+
+		/// Turns a pattern into a tree of nodes. Sets error and stops at the first problem.
+		class Parser
+		{
+		public:
+			explicit Parser(const std::string& pattern) : _pattern(pattern) { }
+
+			std::string error;
+
+			std::unique_ptr<Node> parse()
+			{
+				if (_pattern.compare(0, 4, "(?i)") == 0)
+				{
+					_ignoreCase = true;
+					_pos = 4;
+				}
+
+				auto root = parseAlternate(0);
+				if (error.empty() && _pos < _pattern.size())
+					fail("unmatched )");
+				return root;
+			}
+
+		private:
+			const std::string& _pattern;
+			size_t _pos = 0;
+			bool _ignoreCase = false;
+
+			void fail(const std::string& reason)
+			{
+				if (error.empty())
+					error = reason + " at position " + std::to_string(_pos);
+			}
+
+			bool more() const
+			{
+				return error.empty() && _pos < _pattern.size();
+			}
+
+			char peek() const
+			{
+				return _pattern[_pos];
+			}
+
+			std::unique_ptr<Node> parseAlternate(int depth)
+			{
+				if (depth > MaxDepth)
+				{
+					fail("groups are nested too deeply");
+					return std::make_unique<Node>(Node::Type::Empty);
+				}
+
+				auto node = std::make_unique<Node>(Node::Type::Alternate);
+				node->children.push_back(parseConcat(depth));
+				while (more() && peek() == '|')
+				{
+					++_pos;
+					node->children.push_back(parseConcat(depth));
+				}
+				return node->children.size() == 1 ? std::move(node->children.front()) : std::move(node);
+			}
+
+			std::unique_ptr<Node> parseConcat(int depth)
+			{
+				auto node = std::make_unique<Node>(Node::Type::Concat);
+				while (more() && peek() != '|' && peek() != ')')
+					node->children.push_back(parseRepeat(depth));
+				return node;
+			}
+
+			std::unique_ptr<Node> parseRepeat(int depth)
+			{
+				auto node = parseAtom(depth);
+				while (more())
+				{
+					int min = 0;
+					int max = -1;
+					const auto c = peek();
+					if (c == '*')
+						++_pos;
+					else if (c == '+')
+						++_pos, min = 1;
+					else if (c == '?')
+						++_pos, max = 1;
+					else if (c != '{' || !parseCount(min, max))
+						break;
+
+					// Lazy quantifiers only change which match backtracking finds first, not whether there is one
+					if (more() && peek() == '?')
+						++_pos;
+
+					auto repeat = std::make_unique<Node>(Node::Type::Repeat);
+					repeat->min = min;
+					repeat->max = max;
+					repeat->children.push_back(std::move(node));
+					node = std::move(repeat);
+				}
+				return node;
+			}
+
+			/// {n}, {n,} or {n,m}. Anything else isn't a count, and the { is taken literally.
+			bool parseCount(int& min, int& max)
+			{
+				const auto readNumber = [&](size_t& pos, int& value) {
+					const auto begin = pos;
+					value = 0;
+					// Big numbers are read all the way through so they're reported, but stop growing once they're over the limit
+					while (pos < _pattern.size() && isdigit(static_cast<unsigned char>(_pattern[pos])))
+						value = std::min(value * 10 + (_pattern[pos++] - '0'), MaxRepeat + 1);
+					return pos > begin;
+				};
+
+				auto pos = _pos + 1;
+				if (!readNumber(pos, min))
+					return false;
+				max = min;
+				if (pos < _pattern.size() && _pattern[pos] == ',')
+				{
+					++pos;
+					if (!readNumber(pos, max))
+						max = -1;
+				}
+				if (pos >= _pattern.size() || _pattern[pos] != '}')
+					return false;
+
+				_pos = pos + 1;
+				if (min > MaxRepeat || max > MaxRepeat)
+					fail("repeat count over " + std::to_string(MaxRepeat));
+				else if (max >= 0 && max < min)
+					fail("repeat count {n,m} has m less than n");
+				return true;
+			}
+
+			std::unique_ptr<Node> parseAtom(int depth)
+			{
+				const auto c = _pattern[_pos++];
+				switch (c)
+				{
+				case '(':
+				{
+					if (_pattern.compare(_pos, 2, "?:") == 0)
+						_pos += 2;
+					else if (_pos < _pattern.size() && _pattern[_pos] == '?')
+					{
+						fail("lookaround and inline flags aren't supported");
+						return std::make_unique<Node>(Node::Type::Empty);
+					}
+
+					auto group = parseAlternate(depth + 1);
+					if (error.empty() && (_pos >= _pattern.size() || _pattern[_pos] != ')'))
+						fail("missing )");
+					++_pos;
+					return group;
+				}
+				case '[':
+					return bytes(parseClass());
+				case '.':
+					return bytes(Bytes().set());
+				case '^':
+					return std::make_unique<Node>(Node::Type::Begin);
+				case '$':
+					return std::make_unique<Node>(Node::Type::End);
+				case '*':
+				case '+':
+				case '?':
+					--_pos;
+					fail("nothing to repeat");
+					return std::make_unique<Node>(Node::Type::Empty);
+				case '\\':
+				{
+					Bytes set;
+					parseEscape(set);
+					return bytes(set);
+				}
+				default:
+				{
+					Bytes set;
+					set.set(static_cast<unsigned char>(c));
+					return bytes(set);
+				}
+				}
+			}
+
+			std::unique_ptr<Node> bytes(Bytes set)
+			{
+				foldCase(set);
+				auto node = std::make_unique<Node>(Node::Type::Bytes);
+				node->bytes = set;
+				return node;
+			}
+
+			/// With (?i), add the other case of every letter in set
+			void foldCase(Bytes& set) const
+			{
+				if (!_ignoreCase)
+					return;
+				for (int c = 'a'; c <= 'z'; ++c)
+				{
+					if (set.test(c) || set.test(toupper(c)))
+					{
+						set.set(c);
+						set.set(toupper(c));
+					}
+				}
+			}
+
+			/// After a \, add what it stands for to set. Returns the character if it was a single one, or -1 for a class like \d.
+			int parseEscape(Bytes& set)
+			{
+				if (_pos >= _pattern.size())
+				{
+					fail("trailing \\");
+					return -1;
+				}
+
+				const auto c = _pattern[_pos++];
+				const auto addIf = [&](int (*test)(int), bool negate) {
+					for (int b = 0; b < 256; ++b)
+						if ((test(b) != 0) != negate)
+							set.set(b);
+					return -1;
+				};
+				const auto single = [&](unsigned char value) {
+					set.set(value);
+					return static_cast<int>(value);
+				};
+
+				switch (c)
+				{
+				case 'd': return addIf([](int b) { return b < 128 ? isdigit(b) : 0; }, false);
+				case 'D': return addIf([](int b) { return b < 128 ? isdigit(b) : 0; }, true);
+				case 'w': return addIf([](int b) { return b < 128 ? isalnum(b) || b == '_' : 0; }, false);
+				case 'W': return addIf([](int b) { return b < 128 ? isalnum(b) || b == '_' : 0; }, true);
+				case 's': return addIf([](int b) { return b < 128 ? isspace(b) : 0; }, false);
+				case 'S': return addIf([](int b) { return b < 128 ? isspace(b) : 0; }, true);
+				case 't': return single('\t');
+				case 'n': return single('\n');
+				case 'r': return single('\r');
+				case 'f': return single('\f');
+				case 'v': return single('\v');
+				case 'x':
+				{
+					int value = 0;
+					for (int i = 0; i < 2; ++i)
+					{
+						if (_pos >= _pattern.size() || !isxdigit(static_cast<unsigned char>(_pattern[_pos])))
+						{
+							fail("\\x needs two hex digits");
+							return -1;
+						}
+						const auto digit = _pattern[_pos++];
+						value = value * 16 + (isdigit(static_cast<unsigned char>(digit)) ? digit - '0' : tolower(digit) - 'a' + 10);
+					}
+					return single(static_cast<unsigned char>(value));
+				}
+				case 'b':
+				case 'B':
+					--_pos;
+					fail("word boundaries aren't supported");
+					return -1;
+				default:
+					if (isdigit(static_cast<unsigned char>(c)))
+					{
+						--_pos;
+						fail("backreferences aren't supported");
+						return -1;
+					}
+					if (isalpha(static_cast<unsigned char>(c)))
+					{
+						--_pos;
+						fail(std::string("unknown escape \\") + c);
+						return -1;
+					}
+					return single(static_cast<unsigned char>(c));
+				}
+			}
+
+			/// After a [, up to and including the ]
+			Bytes parseClass()
+			{
+				Bytes set;
+				bool negate = false;
+				if (_pos < _pattern.size() && _pattern[_pos] == '^')
+				{
+					negate = true;
+					++_pos;
+				}
+
+				bool first = true;
+				while (error.empty())
+				{
+					if (_pos >= _pattern.size())
+					{
+						fail("missing ]");
+						break;
+					}
+					if (_pattern[_pos] == ']' && !first)
+					{
+						++_pos;
+						break;
+					}
+					first = false;
+
+					const auto low = classCharacter(set);
+					if (low < 0 || _pos + 1 >= _pattern.size() || _pattern[_pos] != '-' || _pattern[_pos + 1] == ']')
+						continue;
+
+					++_pos;
+					Bytes ignored;
+					const auto high = classCharacter(ignored);
+					if (high < 0)
+					{
+						fail("range in [...] needs a single character at each end");
+						break;
+					}
+					if (high < low)
+					{
+						fail("range in [...] is backwards");
+						break;
+					}
+					for (auto b = low; b <= high; ++b)
+						set.set(b);
+				}
+
+				// Fold before negating, so (?i)[^a] leaves out A as well as a
+				foldCase(set);
+				return negate ? ~set : set;
+			}
+
+			/// One item of a class, added to set. Returns the character, or -1 if it was a class like \d.
+			int classCharacter(Bytes& set)
+			{
+				const auto c = static_cast<unsigned char>(_pattern[_pos++]);
+				if (c == '\\')
+					return parseEscape(set);
+				set.set(c);
+				return c;
+			}
+		};
+
+		/// Instructions of every pattern, one after another
+		std::vector<Instruction> _program;
+
+		/// Where each pattern's instructions start
+		std::vector<int> _starts;
+
+		size_t _patterns = 0;
+
+		/// A set of NFA instructions the automaton could be at
+		struct State
+		{
+			/// Sorted. Only Byte, End and Match instructions, everything else has already been followed.
+			std::vector<int> instructions;
+
+			/// Nothing has been consumed yet, so ^ still matches
+			bool atStart = false;
+
+			/// Patterns that have matched once the automaton gets here
+			std::vector<uint32_t> accepts;
+
+			/// Extra patterns that match if the line ends here, through a $
+			std::vector<uint32_t> endAccepts;
+			bool endAcceptsKnown = false;
+
+			/// State after each byte, -1 if it hasn't been worked out yet
+			std::array<int, 256> next;
+		};
+
+		std::vector<State> _states;
+		std::map<std::pair<bool, std::vector<int>>, int> _stateIds;
+
+		/// State before anything has been consumed, -1 if it hasn't been built since the states were last cleared
+		int _start = -1;
+
+		/// Scratch space for following instructions, and which ones have been visited in the current generation
+		std::vector<int> _stack;
+		std::vector<int> _closure;
+		std::vector<uint32_t> _visited;
+		uint32_t _generation = 0;
+
+		void emit(const Node& node)
+		{
+			if (_program.size() >= MaxInstructions)
+				return;
+
+			switch (node.type)
+			{
+			case Node::Type::Empty:
+				break;
+			case Node::Type::Bytes:
+			{
+				Instruction instruction;
+				instruction.bytes = node.bytes;
+				_program.push_back(instruction);
+				break;
+			}
+			case Node::Type::Begin:
+			case Node::Type::End:
+			{
+				Instruction instruction;
+				instruction.op = node.type == Node::Type::Begin ? Op::Begin : Op::End;
+				_program.push_back(instruction);
+				break;
+			}
+			case Node::Type::Concat:
+				for (const auto& child : node.children)
+					emit(*child);
+				break;
+			case Node::Type::Alternate:
+			{
+				// split next, skip; next: a; jump end; skip: split next, skip; ... z; end:
+				std::vector<size_t> jumps;
+				for (size_t i = 0; i + 1 < node.children.size(); ++i)
+				{
+					const auto split = push(Op::Split);
+					_program[split].x = static_cast<int>(split + 1);
+					emit(*node.children[i]);
+					jumps.push_back(push(Op::Jump));
+					_program[split].y = static_cast<int>(_program.size());
+				}
+				emit(*node.children.back());
+				for (auto jump : jumps)
+					_program[jump].x = static_cast<int>(_program.size());
+				break;
+			}
+			case Node::Type::Repeat:
+			{
+				const auto& child = *node.children.front();
+				for (int i = 0; i < node.min && _program.size() < MaxInstructions; ++i)
+					emit(child);
+
+				if (node.max < 0)
+				{
+					// loop: split body, end; body: child; jump loop; end:
+					const auto split = push(Op::Split);
+					_program[split].x = static_cast<int>(split + 1);
+					emit(child);
+					_program[push(Op::Jump)].x = static_cast<int>(split);
+					_program[split].y = static_cast<int>(_program.size());
+				}
+				else
+				{
+					// Each optional copy can skip straight to the end
+					std::vector<size_t> splits;
+					for (int i = node.min; i < node.max && _program.size() < MaxInstructions; ++i)
+					{
+						const auto split = push(Op::Split);
+						_program[split].x = static_cast<int>(split + 1);
+						splits.push_back(split);
+						emit(child);
+					}
+					for (auto split : splits)
+						_program[split].y = static_cast<int>(_program.size());
+				}
+				break;
+			}
+			}
+		}
+
+		size_t push(Op op)
+		{
+			Instruction instruction;
+			instruction.op = op;
+			_program.push_back(instruction);
+			return _program.size() - 1;
+		}
+
+		void clearStates()
+		{
+			_states.clear();
+			_stateIds.clear();
+			_start = -1;
+		}
+
+		/// Follow every instruction that doesn't consume anything from pc, adding where it ends up to instructions. Instructions already
+		/// visited this generation are skipped, which also stops loops like (a*)* going round forever.
+		void addClosure(int pc, bool atStart, bool atEnd, std::vector<int>& instructions)
+		{
+			_visited.resize(_program.size(), 0);
+			_stack.push_back(pc);
+			while (!_stack.empty())
+			{
+				pc = _stack.back();
+				_stack.pop_back();
+				if (_visited[pc] == _generation)
+					continue;
+				_visited[pc] = _generation;
+
+				const auto& instruction = _program[pc];
+				switch (instruction.op)
+				{
+				case Op::Split:
+					_stack.push_back(instruction.y);
+					_stack.push_back(instruction.x);
+					break;
+				case Op::Jump:
+					_stack.push_back(instruction.x);
+					break;
+				case Op::Begin:
+					if (atStart)
+						_stack.push_back(pc + 1);
+					break;
+				case Op::End:
+					if (atEnd)
+						_stack.push_back(pc + 1);
+					else
+						instructions.push_back(pc);
+					break;
+				case Op::Byte:
+				case Op::Match:
+					instructions.push_back(pc);
+					break;
+				}
+			}
+		}
+
+		/// Index of the state for a set of instructions, building it if it's new
+		int stateFor(std::vector<int>& instructions, bool atStart)
+		{
+			std::sort(instructions.begin(), instructions.end());
+			auto key = std::make_pair(atStart, instructions);
+			auto it = _stateIds.find(key);
+			if (it != _stateIds.end())
+				return it->second;
+
+			State state;
+			state.instructions = instructions;
+			state.atStart = atStart;
+			state.next.fill(-1);
+			for (auto pc : instructions)
+				if (_program[pc].op == Op::Match)
+					state.accepts.push_back(static_cast<uint32_t>(_program[pc].x));
+
+			_states.push_back(std::move(state));
+			const auto id = static_cast<int>(_states.size() - 1);
+			_stateIds.emplace(std::move(key), id);
+			return id;
+		}
+
+		/// State after consuming a byte. Every pattern is started again at each position, so they can match anywhere in the line.
+		int step(int state, unsigned char byte)
+		{
+			_closure.clear();
+			++_generation;
+			for (auto pc : _states[state].instructions)
+				if (_program[pc].op == Op::Byte && _program[pc].bytes.test(byte))
+					addClosure(pc + 1, false, false, _closure);
+			for (auto start : _starts)
+				addClosure(start, false, false, _closure);
+			return stateFor(_closure, false);
+		}
+
+		const std::vector<uint32_t>& endAccepts(int state)
+		{
+			if (!_states[state].endAcceptsKnown)
+			{
+				_closure.clear();
+				++_generation;
+				for (auto pc : _states[state].instructions)
+					if (_program[pc].op == Op::End)
+						addClosure(pc + 1, _states[state].atStart, true, _closure);
+
+				auto& accepts = _states[state].endAccepts;
+				for (auto pc : _closure)
+					if (_program[pc].op == Op::Match)
+						accepts.push_back(static_cast<uint32_t>(_program[pc].x));
+				_states[state].endAcceptsKnown = true;
+			}
+			return _states[state].endAccepts;
+		}
+	};
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+namespace MQ2Discord
+{
+	/// Totals per key in a fixed amount of memory, using the Space-Saving algorithm. Once every counter is in use, a new key takes over
+	/// the counter with the smallest total and inherits it as its possible overcount. Keys with a big enough share of the total are
+	/// always kept, so the top few are right even when there are far more distinct keys than counters. Not threadsafe.
+	class Rollup
+	{
+	public:
+		struct Entry
+		{
+			std::string key;
+
+			/// Total for the key, which may include up to error from whatever key had the counter before
+			double total = 0;
+			double error = 0;
+		};
+
+		/// Longest key that's kept, anything longer is cut short so the memory used stays fixed
+		static constexpr size_t MaxKeyLength = 64;
+
+		explicit Rollup(size_t capacity) : _capacity(std::max<size_t>(capacity, 1))
+		{
+			_entries.reserve(_capacity);
+			_index.reserve(_capacity);
+		}
+
+		void add(std::string key, double amount)
+		{
+			if (key.length() > MaxKeyLength)
+				key.resize(MaxKeyLength);
+
+			++_events;
+			_sum += amount;
+
+			auto it = _index.find(key);
+			if (it != _index.end())
+			{
+				_entries[it->second].total += amount;
+				return;
+			}
+
+			if (_entries.size() < _capacity)
+			{
+				_index.emplace(key, _entries.size());
+				_entries.push_back({ std::move(key), amount, 0 });
+				return;
+			}
+
+			// Full, so the smallest counter goes to the new key
+			const auto smallest = std::min_element(_entries.begin(), _entries.end(), [](const Entry& a, const Entry& b) { return a.total < b.total; });
+			_index.erase(smallest->key);
+			_index.emplace(key, smallest - _entries.begin());
+			smallest->error = smallest->total;
+			smallest->total += amount;
+			smallest->key = std::move(key);
+		}
+
+		/// Up to count entries with the biggest totals, biggest first
+		std::vector<Entry> top(size_t count) const
+		{
+			std::vector<Entry> result(_entries);
+			const auto end = result.begin() + std::min(count, result.size());
+			std::partial_sort(result.begin(), end, result.end(), [](const Entry& a, const Entry& b) { return a.total > b.total; });
+			result.erase(end, result.end());
+			return result;
+		}
+
+		void clear()
+		{
+			_entries.clear();
+			_index.clear();
+			_events = 0;
+			_sum = 0;
+		}
+
+		/// How many values have been added since the last clear
+		uint64_t events() const
+		{
+			return _events;
+		}
+
+		/// Sum of every value added since the last clear, including keys that have since lost their counter
+		double sum() const
+		{
+			return _sum;
+		}
+
+		size_t capacity() const
+		{
+			return _capacity;
+		}
+
+	private:
+		const size_t _capacity;
+		std::vector<Entry> _entries;
+
+		/// Key -> index into _entries
+		std::unordered_map<std::string, size_t> _index;
+
+		uint64_t _events = 0;
+		double _sum = 0;
+	};
+}
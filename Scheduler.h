@@ -0,0 +1,163 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+namespace MQ2Discord
+{
+	/// Budget of requests that refills at a steady rate, for a limit shared by everything sent with one token
+	class TokenBucket
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		/// rate requests per second, saving up at most burst of them. A rate of 0 is unlimited.
+		explicit TokenBucket(double rate = 0, double burst = 1) : _rate(rate), _burst(std::max(burst, 1.0)), _tokens(_burst) { }
+
+		double rate() const
+		{
+			return _rate;
+		}
+
+		/// When there'll be budget for a request, now if there already is
+		Clock::time_point availableAt(Clock::time_point now)
+		{
+			if (_rate <= 0)
+				return now;
+			refill(now);
+			if (_tokens >= 1)
+				return now;
+			return now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1 - _tokens) / _rate));
+		}
+
+		void take(Clock::time_point now)
+		{
+			if (_rate <= 0)
+				return;
+			refill(now);
+			_tokens -= 1;
+		}
+
+		/// Told the limit's been hit anyway, e.g. by something else using the token: nothing more goes until penalty has passed
+		void exhaust(Clock::time_point now, std::chrono::milliseconds penalty)
+		{
+			if (_rate <= 0)
+				return;
+			refill(now);
+			_tokens = std::min(_tokens, 0.0) - std::chrono::duration<double>(penalty).count() * _rate;
+		}
+
+	private:
+		double _rate;
+		double _burst;
+		double _tokens;
+		Clock::time_point _updated;
+
+		void refill(Clock::time_point now)
+		{
+			if (now > _updated)
+			{
+				if (_updated != Clock::time_point())
+					_tokens = std::min(_burst, _tokens + std::chrono::duration<double>(now - _updated).count() * _rate);
+				_updated = now;
+			}
+		}
+	};
+
+	/// Decides which channel sends next when they share a budget, by start-time fair queuing. Each send moves the channel's virtual start
+	/// time on by 1/weight, and the earliest start goes first. Busy channels get sends in proportion to their weights, and a channel that's
+	/// been quiet starts from the current virtual time, so it can't save up a burst.
+	class FairQueue
+	{
+	public:
+		/// Virtual start time of a channel's next send. Lowest goes first.
+		double nextStart(const std::string& channelId) const
+		{
+			auto finish = _finish.find(channelId);
+			return finish == _finish.end() ? _virtualTime : std::max(_virtualTime, finish->second);
+		}
+
+		/// Record a send by a channel
+		void charge(const std::string& channelId, uint32_t weight)
+		{
+			_virtualTime = nextStart(channelId);
+			_finish[channelId] = _virtualTime + 1.0 / std::max<uint32_t>(weight, 1);
+		}
+
+	private:
+		/// Virtual time each channel's last send finished
+		std::map<std::string, double> _finish;
+		double _virtualTime = 0;
+	};
+
+	/// A channel's queued batches and the limits they're sent under, for predicting when they'll all have gone
+	struct Backlog
+	{
+		std::string channelId;
+		uint32_t weight = 1;
+		size_t batches = 0;
+
+		/// Index of the shared TokenBucket the channel sends through
+		size_t budget = 0;
+
+		/// The channel's own rate limit: sends left until resetAt, and then limit sends per window. limit 0 for none.
+		int remaining = 0;
+		TokenBucket::Clock::time_point resetAt;
+		int limit = 0;
+		std::chrono::milliseconds window{ 0 };
+	};
+
+	/// Play the scheduler forward on copies of its state to work out when the last queued batch will be sent, assuming the limits carry on
+	/// as they are and nothing else is queued. Only simulates up to maxBatches sends, and returns when the last of those would go.
+	inline TokenBucket::Clock::time_point predictDrain(std::vector<Backlog> backlogs, std::vector<TokenBucket> budgets, FairQueue queue,
+		TokenBucket::Clock::time_point now, size_t maxBatches = 10000)
+	{
+		auto last = now;
+		for (size_t sent = 0; sent < maxBatches; ++sent)
+		{
+			// Earliest any channel could go, and out of those ready then, the one fair queuing picks
+			Backlog * best = nullptr;
+			auto bestTime = TokenBucket::Clock::time_point::max();
+			double bestStart = 0;
+			for (auto& backlog : backlogs)
+			{
+				if (backlog.batches == 0)
+					continue;
+
+				auto time = std::max(now, budgets[backlog.budget].availableAt(now));
+				if (backlog.limit > 0 && backlog.remaining <= 0)
+					time = std::max(time, backlog.resetAt);
+
+				const auto start = queue.nextStart(backlog.channelId);
+				if (time < bestTime || (time == bestTime && start < bestStart))
+				{
+					best = &backlog;
+					bestTime = time;
+					bestStart = start;
+				}
+			}
+			if (!best)
+				break;
+
+			now = bestTime;
+			if (best->limit > 0)
+			{
+				if (now >= best->resetAt)
+				{
+					best->remaining = best->limit;
+					best->resetAt = now + best->window;
+				}
+				--best->remaining;
+			}
+			budgets[best->budget].take(now);
+			queue.charge(best->channelId, best->weight);
+			--best->batches;
+			last = now;
+		}
+		return last;
+	}
+}
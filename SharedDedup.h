@@ -0,0 +1,155 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace MQ2Discord
+{
+	/// Table of recently sent lines shared by every MQ2Discord on the machine, so when several boxes see the same line only the first one sends it.
+	/// Lives in named shared memory and is lock-free: each slot is a single 64 bit word, claimed with a compare and swap.
+	/// Entries are never removed, they go stale once their time bucket is too old and get overwritten.
+	class SharedDedup
+	{
+	public:
+		/// Number of slots in the table. Part of the shared memory name, so processes with a different size never share a table.
+		static constexpr size_t Slots = 16384;
+
+		/// How far to look past a line's home slot before giving up and sending it anyway
+		static constexpr size_t MaxProbe = 32;
+
+		static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory dedup needs lock-free 64 bit atomics");
+
+		explicit SharedDedup(const std::string& name = "MQ2Discord-dedup")
+		{
+			const auto fullName = name + "-" + std::to_string(Slots);
+			const auto size = Slots * sizeof(std::atomic<uint64_t>);
+#ifdef _WIN32
+			_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(size), ("Local\\" + fullName).c_str());
+			if (!_mapping)
+				return;
+			void * view = MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+			const int fd = shm_open(("/" + fullName).c_str(), O_CREAT | O_RDWR, 0600);
+			if (fd < 0)
+				return;
+			void * view = ftruncate(fd, static_cast<off_t>(size)) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+			close(fd);
+			if (view == MAP_FAILED)
+				view = nullptr;
+#endif
+			// New shared memory is zero filled by the OS, and zero is an empty slot, so there's nothing to initialise
+			_table = static_cast<std::atomic<uint64_t> *>(view);
+		}
+
+		~SharedDedup()
+		{
+#ifdef _WIN32
+			if (_table)
+				UnmapViewOfFile(_table);
+			if (_mapping)
+				CloseHandle(_mapping);
+#else
+			// The name is deliberately left in place, other processes may still be using the table
+			if (_table)
+				munmap(_table, Slots * sizeof(std::atomic<uint64_t>));
+#endif
+		}
+
+		SharedDedup(const SharedDedup&) = delete;
+		SharedDedup& operator=(const SharedDedup&) = delete;
+
+		bool isValid() const
+		{
+			return _table != nullptr;
+		}
+
+		/// The time bucket a line seen now falls into, for a dedup window in milliseconds. Uses the system clock, which every process agrees on.
+		static uint64_t bucket(uint32_t window)
+		{
+			const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			return static_cast<uint64_t>(ms) / (window > 0 ? window : 1);
+		}
+
+		/// Try to claim a line for a channel in a time bucket. Returns true if this process is the first to see it, i.e. it should send it.
+		/// A line claimed in the previous bucket counts too, so boxes that see it either side of a bucket boundary still agree.
+		/// If the table is unavailable or too full to tell, the line is let through; a duplicate beats a lost line.
+		bool claim(std::string_view line, std::string_view channelId, uint64_t bucket)
+		{
+			if (!_table)
+				return true;
+
+			// Top 48 bits identify the line and channel, bottom 16 bits are the bucket. The home slot doesn't depend on the bucket,
+			// so the previous bucket's entry is found along the same probe sequence.
+			const auto hash = mix(fnv1a(line, fnv1a(channelId, 14695981039346656037ull)));
+			const uint64_t identity = (hash & ~BucketMask) != 0 ? hash & ~BucketMask : BucketMask + 1;
+			const uint64_t current = bucket & BucketMask;
+			const uint64_t previous = (bucket - 1) & BucketMask;
+			const uint64_t entry = identity | current;
+
+			const size_t home = static_cast<size_t>(hash >> 16) % Slots;
+			for (size_t probe = 0; probe < MaxProbe; ++probe)
+			{
+				auto& slot = _table[(home + probe) % Slots];
+				uint64_t value = slot.load(std::memory_order_acquire);
+				while (true)
+				{
+					const uint64_t valueBucket = value & BucketMask;
+					const bool live = value != 0 && (valueBucket == current || valueBucket == previous);
+
+					if (live && (value & ~BucketMask) == identity)
+						return false;
+					if (live)
+						break;
+
+					// Empty or stale, so it's ours if nobody else gets there first. If they do, look at what they wrote.
+					if (slot.compare_exchange_weak(value, entry, std::memory_order_acq_rel, std::memory_order_acquire))
+						return true;
+				}
+			}
+
+			return true;
+		}
+
+	private:
+		static constexpr uint64_t BucketMask = 0xFFFF;
+
+		std::atomic<uint64_t> * _table = nullptr;
+
+#ifdef _WIN32
+		HANDLE _mapping = nullptr;
+#endif
+
+		static uint64_t fnv1a(std::string_view s, uint64_t hash)
+		{
+			for (auto c : s)
+			{
+				hash ^= static_cast<uint8_t>(c);
+				hash *= 1099511628211ull;
+			}
+			return hash;
+		}
+
+		/// FNV leaves similar short strings close together in the high bits, which the slot index comes from, so spread them out
+		static uint64_t mix(uint64_t hash)
+		{
+			hash ^= hash >> 33;
+			hash *= 0xff51afd7ed558ccdull;
+			hash ^= hash >> 33;
+			hash *= 0xc4ceb9fe1a85ec53ull;
+			hash ^= hash >> 33;
+			return hash;
+		}
+	};
+}
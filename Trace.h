@@ -0,0 +1,158 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#include "Histogram.h"
+
+namespace MQ2Discord
+{
+	/// Points a relayed line passes on its way from the game to discord, in order
+	enum class TraceStage
+	{
+		/// Seen by OnWriteChatColor or OnIncomingChat
+		Hook,
+		/// Run through the filters
+		Matched,
+		/// Queued for the background thread
+		Enqueued,
+		/// Taken off the queue into its channel's pending lines
+		Batched,
+		/// Request for the batch it's in started, after any rate limit wait
+		Sent,
+		/// Response received
+		Acknowledged,
+		Count
+	};
+
+	/// When a line reached each stage, in microseconds from LatencyTracer::now(). 0 for stages it hasn't reached.
+	using TraceStamps = std::array<uint64_t, static_cast<size_t>(TraceStage::Count)>;
+
+	/// Keeps how long lines spend between each stage, and the stamps of the last few lines so they can be dumped as a trace.
+	/// Threadsafe: lines are recorded on the background thread and stats are read on the main thread.
+	class LatencyTracer
+	{
+	public:
+		/// How many of the most recent lines are kept for the trace dump
+		static constexpr size_t Capacity = 256;
+
+		static uint64_t now()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		static void stamp(TraceStamps& stamps, TraceStage stage)
+		{
+			stamps[static_cast<size_t>(stage)] = now();
+		}
+
+		/// Add a line that's been acknowledged. Lines that didn't come from a chat hook, like replies to commands, aren't traced.
+		void record(const TraceStamps& stamps, const std::string& channelId)
+		{
+			if (stamps[static_cast<size_t>(TraceStage::Hook)] == 0)
+				return;
+
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			// Each stage is timed from the last one the line reached, so a skipped stage doesn't lose the time
+			auto previous = stamps[0];
+			for (size_t i = 1; i < stamps.size(); ++i)
+			{
+				if (stamps[i] == 0)
+					continue;
+				_stages[i].add(stamps[i] >= previous ? stamps[i] - previous : 0);
+				previous = stamps[i];
+			}
+			_total.add(previous - stamps[0]);
+
+			_recent[_next] = { stamps, channelId };
+			_next = (_next + 1) % Capacity;
+			_recentCount = std::min(_recentCount + 1, Capacity);
+		}
+
+		std::vector<std::string> stats() const
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			std::vector<std::string> results;
+			results.push_back("Latency: " + std::to_string(_total.count()) + " lines, p50 " + _total.percentile(0.5) + ", p99 " + _total.percentile(0.99)
+				+ ", max " + LatencyHistogram::format(_total.max()));
+			for (size_t i = 1; i < _stages.size(); ++i)
+			{
+				results.push_back(std::string("  to ") + StageNames[i] + ": p50 " + _stages[i].percentile(0.5) + ", p99 " + _stages[i].percentile(0.99)
+					+ ", max " + LatencyHistogram::format(_stages[i].max()));
+			}
+			return results;
+		}
+
+		/// The last Capacity lines in Chrome's trace event format, for chrome://tracing or Perfetto. Each line gets its own row, with a
+		/// span for the whole trip and one for each stage it reached.
+		std::string chromeTrace() const
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+
+			std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+			bool first = true;
+			const auto event = [&](const char * name, uint64_t start, uint64_t end, size_t row, const std::string& channelId) {
+				if (!first)
+					json += ',';
+				first = false;
+				json += "{\"name\":\"" + std::string(name) + "\",\"cat\":\"mq2discord\",\"ph\":\"X\",\"ts\":" + std::to_string(start)
+					+ ",\"dur\":" + std::to_string(end >= start ? end - start : 0) + ",\"pid\":1,\"tid\":" + std::to_string(row)
+					+ ",\"args\":{\"channel\":\"";
+				for (auto c : channelId)
+				{
+					if (c == '"' || c == '\\')
+						json += '\\';
+					json += c;
+				}
+				json += "\"}}";
+			};
+
+			// Oldest first
+			const size_t oldest = _recentCount < Capacity ? 0 : _next;
+			for (size_t row = 0; row < _recentCount; ++row)
+			{
+				const auto& trace = _recent[(oldest + row) % Capacity];
+				auto previous = trace.stamps[0];
+				for (size_t i = 1; i < trace.stamps.size(); ++i)
+				{
+					if (trace.stamps[i] == 0)
+						continue;
+					event(StageNames[i], previous, trace.stamps[i], row, trace.channelId);
+					previous = trace.stamps[i];
+				}
+				event("line", trace.stamps[0], previous, row, trace.channelId);
+			}
+
+			return json + "]}";
+		}
+
+	private:
+		static constexpr const char * StageNames[] = { "hook", "matched", "enqueued", "batched", "sent", "acknowledged" };
+
+		struct Trace
+		{
+			TraceStamps stamps{};
+			std::string channelId;
+		};
+
+		mutable std::mutex _mutex;
+
+		/// Time from the previous stage to each stage. The first is unused, nothing comes before the hook.
+		std::array<LatencyHistogram, static_cast<size_t>(TraceStage::Count)> _stages{};
+
+		/// Time from the hook to the last stage reached
+		LatencyHistogram _total;
+
+		/// Ring of the most recent lines
+		std::array<Trace, Capacity> _recent{};
+		size_t _next = 0;
+		size_t _recentCount = 0;
+	};
+}
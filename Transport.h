@@ -0,0 +1,300 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <zlib.h>
+
+#pragma warning(push)
+#pragma warning(disable: 4267)
+#include <asio.hpp>
+#pragma warning(pop)
+
+namespace MQ2Discord
+{
+	/// What happened to a send
+	struct TransportResult
+	{
+		bool ok = false;
+
+		/// Not sent because of a rate limit, try again once there's budget
+		bool rateLimited = false;
+
+		/// Id of the message that was posted, for transports that have them
+		std::string messageId;
+
+		/// Rate limit budget left for the channel and when it resets, if the transport reported one. -1 if it didn't.
+		int remaining = -1;
+		std::chrono::milliseconds resetAfter{ 0 };
+
+		/// How many sends the channel's bucket allows per window, if the transport reported it. -1 if it didn't.
+		int limit = -1;
+
+		/// Why it failed, or the raw response for debugging
+		std::string error;
+		std::string response;
+	};
+
+	/// Somewhere batches of lines are delivered to. Batching, rate limiting and formatting happen before this, and are the same for every transport.
+	/// Called only from the client's background thread.
+	class Transport
+	{
+	public:
+		virtual ~Transport() = default;
+
+		/// Send lines, each ending in a newline
+		virtual TransportResult post(const std::string& channelId, const std::string& text) = 0;
+
+		/// Make everything posted so far durable. Called about once a second, posts themselves may be buffered until then.
+		virtual void sync()
+		{
+		}
+
+		/// Longest batch of lines to put in one post
+		virtual size_t maxBatchLength() const
+		{
+			return 1800;
+		}
+
+		/// Whether postEmbeds, postFile, edit and react work. Channels on transports without them get plain posts instead.
+		virtual bool supportsRichMessages() const
+		{
+			return false;
+		}
+
+		/// Post a message from a JSON body of embeds
+		virtual TransportResult postEmbeds(const std::string& channelId, const std::string& body)
+		{
+			return unsupported();
+		}
+
+		/// Upload a file, with a message to go with it
+		virtual TransportResult postFile(const std::string& channelId, const std::filesystem::path& file, const std::string& message)
+		{
+			return unsupported();
+		}
+
+		/// Replace the content of a message posted earlier
+		virtual TransportResult edit(const std::string& channelId, const std::string& messageId, const std::string& content)
+		{
+			return unsupported();
+		}
+
+		/// Add a reaction to a message. emoji is URL encoded.
+		virtual TransportResult react(const std::string& channelId, const std::string& messageId, const std::string& emoji)
+		{
+			return unsupported();
+		}
+
+	protected:
+		static TransportResult unsupported()
+		{
+			TransportResult result;
+			result.error = "Not supported by this transport";
+			return result;
+		}
+
+		/// Local time as text, for sinks that stamp their lines
+		static std::string timestamp()
+		{
+			const auto now = std::time(nullptr);
+			std::tm local{};
+#ifdef _WIN32
+			localtime_s(&local, &now);
+#else
+			localtime_r(&now, &local);
+#endif
+			char buffer[32];
+			std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &local);
+			return buffer;
+		}
+	};
+
+	/// Archives every line to a gzipped log, one line per relayed line as "time<tab>channel<tab>text".
+	/// Once the log reaches maxSize it's rotated: path becomes path.1, path.1 becomes path.2 and so on, keeping at most keep old logs.
+	class FileSinkTransport : public Transport
+	{
+	public:
+		FileSinkTransport(std::filesystem::path path, uint64_t maxSize, uint32_t keep) : _path(std::move(path)), _maxSize(maxSize), _keep(keep)
+		{
+			open();
+		}
+
+		~FileSinkTransport()
+		{
+			if (_file)
+				gzclose(_file);
+		}
+
+		FileSinkTransport(const FileSinkTransport&) = delete;
+		FileSinkTransport& operator=(const FileSinkTransport&) = delete;
+
+		TransportResult post(const std::string& channelId, const std::string& text) override
+		{
+			TransportResult result;
+			if (!_file && !open())
+			{
+				result.error = "Couldn't open " + _path.string();
+				return result;
+			}
+
+			const auto prefix = timestamp() + '\t' + channelId + '\t';
+			bool written = true;
+			size_t start = 0;
+			while (start < text.size())
+			{
+				auto end = text.find('\n', start);
+				end = end == std::string::npos ? text.size() : end + 1;
+				written &= gzwrite(_file, prefix.data(), static_cast<unsigned>(prefix.size())) > 0;
+				written &= gzwrite(_file, text.data() + start, static_cast<unsigned>(end - start)) > 0;
+				if (text[end - 1] != '\n')
+					written &= gzputc(_file, '\n') >= 0;
+				start = end;
+			}
+
+			// Flush points cost compression and a write each, so they're left to sync rather than made for every batch
+			_unsynced = true;
+			result.ok = written;
+			if (!result.ok)
+				result.error = "Couldn't write to " + _path.string();
+
+			if (_maxSize > 0 && gzoffset(_file) >= static_cast<z_off_t>(_maxSize))
+				rotate();
+			return result;
+		}
+
+		/// End on a flush point, so everything posted so far can be read back even if the game crashes
+		void sync() override
+		{
+			if (_file && _unsynced)
+				gzflush(_file, Z_SYNC_FLUSH);
+			_unsynced = false;
+		}
+
+		size_t maxBatchLength() const override
+		{
+			return 64 * 1024;
+		}
+
+	private:
+		const std::filesystem::path _path;
+		const uint64_t _maxSize;
+		const uint32_t _keep;
+		gzFile _file = nullptr;
+
+		/// Whether anything's been written since the last flush point. Closing the file for a rotation or on shutdown flushes it too.
+		bool _unsynced = false;
+
+		bool open()
+		{
+			std::error_code ec;
+			if (_path.has_parent_path())
+				std::filesystem::create_directories(_path.parent_path(), ec);
+
+			// Appending adds another gzip member, which every gzip reader treats as one continuous file
+			_file = gzopen(_path.string().c_str(), "ab");
+			if (_file)
+				gzbuffer(_file, 64 * 1024);
+			return _file != nullptr;
+		}
+
+		std::filesystem::path rotated(uint32_t number) const
+		{
+			return _path.string() + "." + std::to_string(number);
+		}
+
+		void rotate()
+		{
+			gzclose(_file);
+			_file = nullptr;
+			_unsynced = false;
+
+			std::error_code ec;
+			if (_keep == 0)
+			{
+				std::filesystem::remove(_path, ec);
+			}
+			else
+			{
+				std::filesystem::remove(rotated(_keep), ec);
+				for (auto number = _keep; number > 1; --number)
+					std::filesystem::rename(rotated(number - 1), rotated(number), ec);
+				std::filesystem::rename(_path, rotated(1), ec);
+			}
+			open();
+		}
+	};
+
+	/// Sends every line as its own UDP datagram, "channel<tab>text", e.g. to feed a local dashboard. Fire and forget, so it never reports a rate limit.
+	class UdpSinkTransport : public Transport
+	{
+	public:
+		/// target is "address:port", with a numeric address
+		UdpSinkTransport(asio::io_context& io, const std::string& target) : _socket(io)
+		{
+			const auto colon = target.rfind(':');
+			if (colon == std::string::npos)
+				return;
+
+			asio::error_code ec;
+			const auto address = asio::ip::make_address(target.substr(0, colon), ec);
+			if (ec)
+				return;
+			try
+			{
+				_endpoint = asio::ip::udp::endpoint(address, static_cast<unsigned short>(std::stoul(target.substr(colon + 1))));
+			}
+			catch (...)
+			{
+				return;
+			}
+
+			_socket.open(_endpoint.protocol(), ec);
+			_valid = !ec;
+		}
+
+		TransportResult post(const std::string& channelId, const std::string& text) override
+		{
+			TransportResult result;
+			if (!_valid)
+			{
+				result.error = "UDP sink has no valid address";
+				return result;
+			}
+
+			result.ok = true;
+			std::string datagram;
+			size_t start = 0;
+			while (start < text.size())
+			{
+				auto end = text.find('\n', start);
+				if (end == std::string::npos)
+					end = text.size();
+				if (end > start)
+				{
+					datagram = channelId + '\t' + text.substr(start, end - start);
+					asio::error_code ec;
+					_socket.send_to(asio::buffer(datagram.data(), datagram.size()), _endpoint, 0, ec);
+					if (ec)
+					{
+						result.ok = false;
+						result.error = ec.message();
+					}
+				}
+				start = end + 1;
+			}
+			return result;
+		}
+
+		size_t maxBatchLength() const override
+		{
+			return 64 * 1024;
+		}
+
+	private:
+		asio::ip::udp::socket _socket;
+		asio::ip::udp::endpoint _endpoint;
+		bool _valid = false;
+	};
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdio>
+
+// Minimal assertions for the header tests. A failed check is reported and the test carries on, so one run shows every failure.
+// Each test's main returns Failures, so ctest sees a non-zero exit if anything failed.
+
+inline int Failures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			++Failures; \
+		} \
+	} while (false)
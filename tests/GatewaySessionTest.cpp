@@ -0,0 +1,81 @@
+#include "GatewaySession.h"
+#include "Check.h"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+using namespace MQ2Discord;
+
+namespace
+{
+	GatewaySession Session(const std::string& id, const std::string& url)
+	{
+		GatewaySession session;
+		session.sessionId = id;
+		session.sequence = 42;
+		session.resumeUrl = url;
+		return session;
+	}
+
+	void TestValid()
+	{
+		CHECK(Session("0123abcdEF", "wss://gateway-us-east1-b.discord.gg").valid());
+		CHECK(Session("0123abcdEF", "wss://gateway.discord.gg/?v=10").valid());
+
+		CHECK(!Session("", "wss://gateway.discord.gg").valid());
+		CHECK(!GatewaySession().valid());
+
+		// Anything that could break out of the stand-in READY's strings
+		CHECK(!Session("abc\"", "wss://gateway.discord.gg").valid());
+		CHECK(!Session("abc\\", "wss://gateway.discord.gg").valid());
+		CHECK(!Session("abc-def", "wss://gateway.discord.gg").valid());
+		CHECK(!Session("abc", "wss://gateway.discord.gg\",\"op\":2").valid());
+		CHECK(!Session("abc", "wss://gateway.discord.gg\\").valid());
+		CHECK(!Session("abc", "wss://gateway.discord.gg\n").valid());
+		CHECK(!Session("abc", "wss://gateway.discord.gg/a b").valid());
+
+		// Only secure websockets, with a host
+		CHECK(!Session("abc", "").valid());
+		CHECK(!Session("abc", "wss://").valid());
+		CHECK(!Session("abc", "ws://gateway.discord.gg").valid());
+		CHECK(!Session("abc", "https://gateway.discord.gg").valid());
+	}
+
+	/// Sessions go through a file between plugin loads, and one that's been tampered with is read back as no session
+	void TestFiles()
+	{
+		const auto directory = std::filesystem::temp_directory_path() / ("MQ2DiscordSessionTest" + std::to_string(std::rand()));
+
+		GatewaySessionStore::checkIn(directory, "good", Session("abc123", "wss://gateway.discord.gg"));
+		GatewaySessionStore::checkIn(directory, "bad", Session("abc123", "wss://gateway.discord.gg"));
+		{
+			std::ofstream output(directory / "bad.session", std::ios::trunc);
+			output << "abc\",\"op\":2\n" << 42 << '\n' << "wss://gateway.discord.gg\n";
+		}
+
+		// Checked out once from memory, then dropped from it, so the next check out comes from the file
+		for (const auto * key : { "good", "bad" })
+		{
+			CHECK(GatewaySessionStore::checkOut(directory, key, std::chrono::milliseconds(0)));
+			GatewaySessionStore::checkIn({}, key, {});
+		}
+
+		const auto good = GatewaySessionStore::checkOut(directory, "good", std::chrono::milliseconds(0));
+		CHECK(good && good->valid() && good->sessionId == "abc123" && good->sequence == 42 && good->resumeUrl == "wss://gateway.discord.gg");
+
+		const auto bad = GatewaySessionStore::checkOut(directory, "bad", std::chrono::milliseconds(0));
+		CHECK(bad && !bad->valid());
+
+		std::error_code ec;
+		std::filesystem::remove_all(directory, ec);
+	}
+}
+
+int main()
+{
+	TestValid();
+	TestFiles();
+	return Failures;
+}
@@ -0,0 +1,151 @@
+#include "Gateway.h"
+#include "Check.h"
+
+#include <string>
+#include <vector>
+
+using namespace MQ2Discord;
+
+namespace
+{
+	/// Peek a copy of the payload, so a read past its end is a read past the end of its own buffer. The copy is kept until the next call,
+	/// as the results are views into it.
+	bool Peek(const std::string& json, GatewayPeek& result)
+	{
+		static std::vector<char> copy;
+		copy.assign(json.begin(), json.end());
+		return GatewayScanner::peek(std::string_view(copy.data(), copy.size()), result);
+	}
+
+	void TestMessageCreate()
+	{
+		GatewayPeek peek;
+		CHECK(Peek(R"({"t":"MESSAGE_CREATE","s":42,"op":0,"d":{"referenced_message":{"channel_id":"999","author":{"id":"5"}},)"
+			R"("content":"a \"}x","author":{"username":"x","id":"123"},"channel_id":"777","n":[1,{"a":"]"}],"b":true}})", peek));
+		CHECK(peek.op == 0);
+		CHECK(peek.s == 42);
+		CHECK(peek.t == "MESSAGE_CREATE");
+		CHECK(peek.channelId == "777");
+		CHECK(peek.authorId == "123");
+	}
+
+	void TestHelloAndReady()
+	{
+		GatewayPeek hello;
+		CHECK(Peek(R"({"op":10,"d":{"heartbeat_interval":41250},"s":null,"t":null})", hello));
+		CHECK(hello.op == 10);
+		CHECK(hello.s == -1);
+		CHECK(hello.heartbeatInterval == 41250);
+
+		GatewayPeek ready;
+		CHECK(Peek(R"({"op":0,"s":1,"t":"READY","d":{"session_id":"abc123","resume_gateway_url":"wss://gateway.discord.gg"}})", ready));
+		CHECK(ready.sessionId == "abc123");
+		CHECK(ready.resumeUrl == "wss://gateway.discord.gg");
+	}
+
+	/// Every prefix of a valid payload is a truncated frame. None can be read past the end, and none but the whole thing is valid.
+	void TestTruncated()
+	{
+		const std::string payloads[] = {
+			R"({"op":0,"s":-12,"t":"MESSAGE_CREATE","d":{"channel_id":"777","author":{"id":"123"},"content":"x \\ \"y\""}})",
+			R"({"op":10,"d":{"heartbeat_interval":41250}})",
+			R"({"op":11,"d":null,"s":null,"t":null})",
+			R"({"op":0,"d":{"a":[1,[2,{"b":"]}"}],3],"c":true}})",
+		};
+		for (const auto& payload : payloads)
+		{
+			for (size_t length = 0; length < payload.size(); ++length)
+			{
+				GatewayPeek peek;
+				CHECK(!Peek(payload.substr(0, length), peek));
+			}
+			GatewayPeek peek;
+			CHECK(Peek(payload, peek));
+		}
+	}
+
+	void TestMalformed()
+	{
+		const std::string payloads[] = {
+			"",
+			"{",
+			"}",
+			"[]",
+			R"({"op":})",
+			R"({"op":-})",
+			R"({"op":-x})",
+			R"({"op" 1})",
+			R"({"op":1,})",
+			R"({"op":1 "s":2})",
+			R"({op:1})",
+			R"({"op":"1)",
+			R"({"op":1,"d":{"channel_id":"7)",
+			R"({"op":1,"d":{"author":{"id":)",
+			"{\"op\":1,\"t\":\"\\",
+		};
+		for (const auto& payload : payloads)
+		{
+			GatewayPeek peek;
+			CHECK(!Peek(payload, peek));
+		}
+	}
+
+	void TestSnowflake()
+	{
+		CHECK(isSnowflake("86753098675309"));
+		CHECK(!isSnowflake(""));
+		CHECK(!isSnowflake("123\"},\"x\":\"1"));
+		CHECK(!isSnowflake("12a"));
+		CHECK(!isSnowflake("123456789012345678901"));
+	}
+
+	/// Compress with a sync flush, the way the gateway does
+	std::string Deflate(z_stream& stream, const std::string& text)
+	{
+		std::string output(text.size() + 1024, '\0');
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+		stream.avail_in = static_cast<uInt>(text.size());
+		stream.next_out = reinterpret_cast<Bytef *>(output.data());
+		stream.avail_out = static_cast<uInt>(output.size());
+		deflate(&stream, Z_SYNC_FLUSH);
+		output.resize(output.size() - stream.avail_out);
+		return output;
+	}
+
+	void TestInflater()
+	{
+		z_stream stream{};
+		deflateInit(&stream, 6);
+		ZlibStreamInflater inflater;
+		CHECK(inflater.isValid());
+
+		std::string output;
+		for (const auto& message : { std::string("{\"op\":11}"), std::string(100000, 'x') })
+		{
+			const auto compressed = Deflate(stream, message);
+			CHECK(inflater.feed(compressed.substr(0, 3), output) == InflateResult::Partial);
+			CHECK(inflater.feed(compressed.substr(3), output) == InflateResult::Complete);
+			CHECK(output == message);
+		}
+		deflateEnd(&stream);
+
+		// Corrupt data fails, and the reset inflater can start a new stream
+		CHECK(inflater.feed(std::string("\xff\xff\xff\xff\x00\x00\xff\xff", 8), output) == InflateResult::Failed);
+		z_stream fresh{};
+		deflateInit(&fresh, 6);
+		CHECK(inflater.feed(Deflate(fresh, "again"), output) == InflateResult::Complete);
+		CHECK(output == "again");
+		deflateEnd(&fresh);
+	}
+}
+
+int main()
+{
+	TestMessageCreate();
+	TestHelloAndReady();
+	TestTruncated();
+	TestMalformed();
+	TestSnowflake();
+	TestInflater();
+	return Failures;
+}
@@ -0,0 +1,100 @@
+#include "Regex.h"
+#include "Check.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace MQ2Discord;
+
+namespace
+{
+	/// Lines with known answers
+	void TestMatches()
+	{
+		struct MatchCase
+		{
+			const char * pattern;
+			const char * text;
+			bool expected;
+		};
+		static constexpr MatchCase Matches[] = {
+			{ "^Soandso tells you", "Soandso tells you, 'hi'", true },
+			{ "^Soandso tells you", "Bob says, Soandso tells you", false },
+			{ "damage\\.$", "You hit a gnoll for 5 points of damage.", true },
+			{ "damage\\.$", "damage. Not at the end", false },
+			{ "^$", "", true },
+			{ "^(tell|say|shout)s you", "shouts you", true },
+			{ "^(tell|say|shout)s you", "whispers you", false },
+			{ "a|b|c", "xxc", true },
+			{ "^x{3}$", "xxx", true },
+			{ "^x{3}$", "xxxx", false },
+			{ "^x{2,}$", "x", false },
+			{ "^x{2,}$", "xxxxx", true },
+			{ "^x{1,2}y$", "xxxy", false },
+			{ "^\\d+ points", "123 points", true },
+			{ "(a*)*b", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", false },
+			{ "(?i)^hail", "HAIL, Guard", true },
+			{ "(?i)[^a]", "a", false },
+			{ "(?i)[^a]", "A", false },
+			{ "(?i)[^a]", "b", true },
+			{ "(?i)^[^a-c]+$", "DEF", true },
+			{ "(?i)^[^a-c]+$", "dBe", false },
+			{ "[^a]", "A", true },
+			{ "x{2}", "x{2}", false },
+		};
+
+		std::vector<bool> results;
+		for (const auto& test : Matches)
+		{
+			RegexSet regex;
+			std::string error;
+			const bool compiled = regex.add(test.pattern, error);
+			const bool correct = compiled && regex.match(test.text, results) == test.expected;
+			if (!correct)
+				std::fprintf(stderr, "re:%s on \"%s\": %s\n", test.pattern, test.text, compiled ? "wrong answer" : error.c_str());
+			CHECK(correct);
+		}
+	}
+
+	/// Patterns with known errors
+	void TestErrors()
+	{
+		struct ErrorCase
+		{
+			const char * pattern;
+			const char * error;
+		};
+		static constexpr ErrorCase Errors[] = {
+			{ "x{99999}", "repeat count over 1000" },
+			{ "x{1001}", "repeat count over 1000" },
+			{ "x{3,2}", "repeat count {n,m} has m less than n" },
+			{ "(abc", "missing )" },
+			{ "abc)", "unmatched )" },
+			{ "[abc", "missing ]" },
+			{ "[z-a]", "range in [...] is backwards" },
+			{ "*a", "nothing to repeat" },
+			{ "(a)\\1", "backreferences aren't supported" },
+			{ "\\bword", "word boundaries aren't supported" },
+			{ "(?=a)", "lookaround and inline flags aren't supported" },
+			{ "\\q", "unknown escape \\q" },
+			{ "\\x4", "\\x needs two hex digits" },
+		};
+
+		for (const auto& test : Errors)
+		{
+			const auto error = RegexSet::check(test.pattern);
+			const bool correct = error.compare(0, std::string(test.error).size(), test.error) == 0;
+			if (!correct)
+				std::fprintf(stderr, "re:%s should fail with \"%s\", got \"%s\"\n", test.pattern, test.error, error.c_str());
+			CHECK(correct);
+		}
+	}
+}
+
+int main()
+{
+	TestMatches();
+	TestErrors();
+	return Failures;
+}
@@ -0,0 +1,121 @@
+#include "SharedDedup.h"
+#include "Check.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace MQ2Discord;
+
+namespace
+{
+	constexpr int Processes = 8;
+	constexpr int Lines = 2000;
+	constexpr int Rounds = 20;
+
+	/// A table of its own for each run, so tests running side by side or a table left over from the plugin don't get in the way
+	const std::string Name = "MQ2Discord-dedup-test-" + std::to_string(getpid());
+
+	/// Shared between the forked processes: how many have reached the barrier, then how many times each line was claimed
+	struct Results
+	{
+		std::atomic<int> arrived;
+		std::atomic<int> claims[Lines];
+	};
+
+	/// Wait until every process has arrived here this many times
+	void Barrier(Results& results, int times)
+	{
+		++results.arrived;
+		while (results.arrived.load() < times * Processes)
+			sched_yield();
+	}
+
+	void TestSingleProcess()
+	{
+		SharedDedup dedup(Name);
+		CHECK(dedup.isValid());
+
+		CHECK(dedup.claim("You have been slain", "1", 100));
+		CHECK(!dedup.claim("You have been slain", "1", 100));
+
+		// Another channel or line is claimed separately
+		CHECK(dedup.claim("You have been slain", "2", 100));
+		CHECK(dedup.claim("You have been slain!", "1", 100));
+
+		// Still a duplicate in the next bucket, but not once the claim is two buckets old
+		CHECK(!dedup.claim("You have been slain", "1", 101));
+		CHECK(dedup.claim("You have been slain", "1", 102));
+
+		// A second handle on the same table sees the same claims
+		SharedDedup other(Name);
+		CHECK(!other.claim("You have been slain", "2", 100));
+	}
+
+	/// Several processes claim the same lines at once, and only one of them may get each line in each round
+	void TestManyProcesses()
+	{
+		void * shared = mmap(nullptr, sizeof(Results), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		CHECK(shared != MAP_FAILED);
+		if (shared == MAP_FAILED)
+			return;
+		auto * results = new (shared) Results{};
+
+		std::vector<pid_t> children;
+		for (int i = 0; i < Processes; ++i)
+		{
+			const pid_t pid = fork();
+			if (pid == 0)
+			{
+				// A process that can't open the table still takes part in the barriers, so the others aren't left waiting for it
+				SharedDedup dedup(Name);
+
+				// Everyone goes through the lines in the same order, so the processes race for the same slots. Each round is two buckets on
+				// from the last, so its claims are all new and overwrite the last round's. The rounds start together, as they would with
+				// every process reading the same clock; one still on an old bucket would see the newer claims as stale.
+				for (int round = 0; round < Rounds; ++round)
+				{
+					Barrier(*results, round + 1);
+					for (int line = 0; line < Lines && dedup.isValid(); ++line)
+						if (dedup.claim("Line " + std::to_string(line), "channel", 5000 + 2 * round))
+							++results->claims[line];
+				}
+				_exit(dedup.isValid() ? 0 : 1);
+			}
+			CHECK(pid > 0);
+			if (pid > 0)
+				children.push_back(pid);
+			else
+				results->arrived += Rounds;	// Arrive for it at every barrier
+		}
+
+		for (const auto pid : children)
+		{
+			int status = 0;
+			CHECK(waitpid(pid, &status, 0) == pid);
+			CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		}
+
+		int wrong = 0;
+		for (int line = 0; line < Lines; ++line)
+			if (results->claims[line].load() != Rounds)
+				++wrong;
+		CHECK(wrong == 0);
+
+		munmap(shared, sizeof(Results));
+	}
+}
+
+int main()
+{
+	TestSingleProcess();
+	TestManyProcesses();
+
+	// The plugin leaves its table's name in place for other processes, the test cleans up after itself
+	shm_unlink(("/" + Name + "-" + std::to_string(SharedDedup::Slots)).c_str());
+	return Failures;
+}